@@ -6,6 +6,12 @@ import {
 
 interface ESP32DeviceConfig extends DeviceConfig {
     sd?: SdCardConfig
+    loop?: LoopConfig
+    ledStrip?: LedStripConfig
+    fstor?: FstorConfig
+    wifi?: WifiConfig
+    adc?: AdcConfig
+    pwm?: PwmConfig
 }
 
 interface ESP32ArchConfig extends ArchConfig {}
@@ -15,4 +21,173 @@ interface SdCardConfig extends JsonComment {
     pinMOSI: Pin
     pinSCK: Pin
     pinCS: Pin
+
+    /**
+     * Data lines 1 and 2 for 4-bit SD bus mode (ESP32 and ESP32-S3 only).
+     * In that mode, pinSCK is CLK, pinMOSI is CMD, pinMISO is D0 and pinCS is D3.
+     * On ESP32, these have to be the fixed SDMMC slot 1 pins (14, 15, 2, 4, 12, 13).
+     */
+    pinD1?: Pin
+    pinD2?: Pin
+
+    /**
+     * Maximum SPI clock for the SD card; falls back to 20MHz if the card doesn't initialize.
+     *
+     * @default 40
+     */
+    maxMHz?: number
+}
+
+interface LoopConfig extends JsonComment {
+    /**
+     * Log main loop phases taking longer than this many microseconds.
+     *
+     * @default 20000
+     */
+    budgetUs?: number
+
+    /**
+     * Budget for Jacdac packet processing and the VM, in microseconds; defaults to budgetUs.
+     */
+    jdProcessBudgetUs?: number
+
+    /**
+     * Budget for work queued on the main task, in microseconds; defaults to budgetUs.
+     */
+    workerBudgetUs?: number
+
+    /**
+     * Budget for TCP socket processing, in microseconds; defaults to budgetUs.
+     */
+    tcpsockBudgetUs?: number
+
+    /**
+     * Budget for log output and diagnostics, in microseconds; defaults to budgetUs.
+     */
+    dmesgBudgetUs?: number
+
+    /**
+     * If set, report main loop phase statistics to dmesg every this many seconds.
+     * Otherwise, they are only reported (every minute) when the budget was exceeded.
+     */
+    reportS?: number
+}
+
+interface LedStripConfig extends JsonComment {
+    /**
+     * Scale all bytes sent to LED strips by (brightness + 1) / 256.
+     * 0 disables scaling.
+     */
+    brightness?: number
+
+    /**
+     * Gamma correction exponent applied when sending, times 10 (eg. 22 for 2.2).
+     * 0 disables gamma correction.
+     */
+    gamma10?: number
+
+    /**
+     * Output byte order of each pixel, as indices of input bytes; eg. "102" swaps first two bytes.
+     */
+    order?: string
+
+    /**
+     * Send 4 bytes per pixel, with the white channel extracted from the 3 input bytes.
+     */
+    rgbw?: boolean
+
+    /**
+     * If set, LED strips are APA102/SK9822 (clocked) and driven over SPI, with this clock pin.
+     */
+    pinCLK?: Pin
+
+    /**
+     * SPI clock for APA102/SK9822 strips.
+     *
+     * @default 8
+     */
+    clockMHz?: number
+}
+
+interface FstorConfig extends JsonComment {
+    /**
+     * After a deploy to another fstor slot, roll back to the previous one if the new one
+     * wasn't confirmed within this many boots.
+     *
+     * @default 3
+     */
+    trialBoots?: number
+
+    /**
+     * Confirm a newly deployed fstor slot once the VM has been running for this many seconds.
+     *
+     * @default 30
+     */
+    confirmS?: number
+}
+
+interface AdcConfig extends JsonComment {
+    /**
+     * If set, analog readings are calibrated (with the attenuation picked per reading),
+     * and this many millivolts reads as full scale; typically the supply voltage.
+     * Otherwise, raw readings at the widest range are used.
+     */
+    fullScaleMv?: number
+
+    /**
+     * Sample these pins continuously (up to 8, ADC1 only); analog readings of them then return
+     * the mean over the last streamDecimation samples.
+     */
+    streamPins?: Pin[]
+
+    /**
+     * Sample rate of each streamed pin.
+     *
+     * @default 20000
+     */
+    streamHz?: number
+
+    /**
+     * Number of samples averaged per streamed reading.
+     *
+     * @default 64
+     */
+    streamDecimation?: number
+}
+
+interface PwmConfig extends JsonComment {
+    /**
+     * If set, PWM duty changes (LEDs, servos, etc.) fade in hardware over this many
+     * milliseconds, instead of taking effect immediately. Not available on MCPWM outputs.
+     */
+    fadeMs?: number
+}
+
+interface WifiConfig extends JsonComment {
+    /**
+     * Power-save vs. throughput trade-off:
+     * "throughput" disables power save and allows 40MHz channels,
+     * "balanced" sleeps between DTIM beacons,
+     * "lowPower" sleeps for listenInterval beacons (adding that much latency).
+     *
+     * @default "balanced"
+     */
+    profile?: "throughput" | "balanced" | "lowPower"
+
+    /**
+     * Number of beacon intervals to sleep for in "lowPower" profile.
+     *
+     * @default 10
+     */
+    listenInterval?: number
+
+    /**
+     * Limit transmit power, in dBm (2 to 20).
+     */
+    maxTxPowerDbm?: number
+
+    /**
+     * Address ("host" or "host:port") of scripts/wifibench.js; only used in builds with JD_WIFI_BENCH.
+     */
+    benchHost?: string
 }
@@ -1,12 +1,18 @@
 #include "jdesp.h"
 #include "esp_adc/adc_oneshot.h"
+#include "esp_adc/adc_continuous.h"
+#include "esp_adc/adc_cali.h"
+#include "esp_adc/adc_cali_scheme.h"
 #include "hal/adc_hal.h"
+#include "esp_cpu.h"
+#include <math.h>
 
 #define LOG_TAG "adc"
 #include "devs_logging.h"
 
 #define ADC_ATTEN ADC_ATTEN_DB_11
 #define ADC_BITS SOC_ADC_RTC_MAX_BITWIDTH
+#define ADC_MAX_RAW ((1 << ADC_BITS) - 1)
 
 #if CONFIG_IDF_TARGET_ESP32
 #define CH_OFFSET 32
@@ -55,7 +61,8 @@ static uint8_t channels[] = {
 #error "unknown ESP32"
 #endif
 
-static uint32_t inited_channels;
+// attenuation + 1 the channel is configured for; 0 if not configured
+static uint8_t chan_atten[SOC_ADC_MAX_CHANNEL_NUM];
 static adc_oneshot_unit_handle_t adc1_handle;
 
 static int adc_ch(uint8_t pin) {
@@ -84,23 +91,445 @@ bool adc_can_read_pin(uint8_t pin) {
     return adc_ch(pin) != -1;
 }
 
-uint16_t adc_read_pin(uint8_t pin) {
-    int ch = adc_ch(pin);
-    if (ch < 0)
-        return 0;
-    if (!(inited_channels & (1 << ch))) {
+static int stream_last_value(int ch);
+static void stream_pause(bool pause);
+
+static int read_raw(int ch, adc_atten_t atten) {
+    // ADC1 is owned by the continuous driver while streaming
+    stream_pause(true);
+
+    if (chan_atten[ch] != atten + 1) {
         adc_init();
-        inited_channels |= 1 << ch;
+        chan_atten[ch] = atten + 1;
         adc_oneshot_chan_cfg_t config = {
             .bitwidth = ADC_BITS,
-            .atten = ADC_ATTEN,
+            .atten = atten,
         };
         CHK(adc_oneshot_config_channel(adc1_handle, ch, &config));
     }
 
     int res;
-    CHK(adc_oneshot_read(adc1_handle, ch, &res));
-    return res << (16 - ADC_BITS);
+    esp_err_t err = adc_oneshot_read(adc1_handle, ch, &res);
+    stream_pause(false);
+    CHK(err);
+    return res;
+}
+
+static int full_scale_mv = -1;
+
+uint16_t adc_read_pin(uint8_t pin) {
+    int ch = adc_ch(pin);
+    if (ch < 0)
+        return 0;
+
+    if (full_scale_mv < 0)
+        full_scale_mv = dcfg_get_i32("adc.fullScaleMv", 0);
+    if (full_scale_mv > 0) {
+        int mv = adc_read_pin_mv(pin);
+        if (mv >= full_scale_mv)
+            return 0xffff;
+        return mv * 0xffff / full_scale_mv;
+    }
+
+    int v = stream_last_value(ch);
+    if (v >= 0)
+        return v;
+
+    return read_raw(ch, ADC_ATTEN) << (16 - ADC_BITS);
+}
+
+// Calibration (eFuse-based curve or line fitting) is evaluated once per attenuation at
+// CALI_SEGMENTS + 1 points; readings are then converted by integer linear interpolation.
+
+#define CALI_SEGMENTS 32
+#define CALI_STEP ((ADC_MAX_RAW + 1) / CALI_SEGMENTS)
+#define NUM_ATTEN (ADC_ATTEN_DB_11 + 1)
+
+typedef struct {
+    uint16_t mv[CALI_SEGMENTS + 1];
+} cali_table_t;
+
+static cali_table_t *cali_tables[NUM_ATTEN];
+
+// used when the chip has no calibration data
+static const uint16_t nominal_max_mv[NUM_ATTEN] = {950, 1250, 1750, 3100};
+
+static const cali_table_t *get_cali(adc_atten_t atten) {
+    if (cali_tables[atten])
+        return cali_tables[atten];
+
+    cali_table_t *t = jd_alloc(sizeof(cali_table_t));
+    adc_cali_handle_t handle = NULL;
+    esp_err_t r = ESP_ERR_NOT_SUPPORTED;
+
+#if ADC_CALI_SCHEME_CURVE_FITTING_SUPPORTED
+    adc_cali_curve_fitting_config_t cfg = {
+        .unit_id = ADC_UNIT_1,
+        .atten = atten,
+        .bitwidth = ADC_BITS,
+    };
+    r = adc_cali_create_scheme_curve_fitting(&cfg, &handle);
+#elif ADC_CALI_SCHEME_LINE_FITTING_SUPPORTED
+    adc_cali_line_fitting_config_t cfg = {
+        .unit_id = ADC_UNIT_1,
+        .atten = atten,
+        .bitwidth = ADC_BITS,
+#if CONFIG_IDF_TARGET_ESP32
+        .default_vref = 1100,
+#endif
+    };
+    r = adc_cali_create_scheme_line_fitting(&cfg, &handle);
+#endif
+
+    for (int i = 0; i <= CALI_SEGMENTS; ++i) {
+        int raw = i * CALI_STEP;
+        if (raw > ADC_MAX_RAW)
+            raw = ADC_MAX_RAW;
+        int mv;
+        if (r != ESP_OK || adc_cali_raw_to_voltage(handle, raw, &mv) != ESP_OK)
+            mv = raw * nominal_max_mv[atten] / ADC_MAX_RAW;
+        t->mv[i] = mv;
+    }
+
+    if (r == ESP_OK) {
+#if ADC_CALI_SCHEME_CURVE_FITTING_SUPPORTED
+        adc_cali_delete_scheme_curve_fitting(handle);
+#elif ADC_CALI_SCHEME_LINE_FITTING_SUPPORTED
+        adc_cali_delete_scheme_line_fitting(handle);
+#endif
+    }
+
+    LOG("atten %d: %s, %d-%dmV", atten, r == ESP_OK ? "calibrated" : "nominal", t->mv[0],
+        t->mv[CALI_SEGMENTS]);
+
+    cali_tables[atten] = t;
+    return t;
+}
+
+static int raw_to_mv(const cali_table_t *t, int raw) {
+    if (raw >= ADC_MAX_RAW)
+        return t->mv[CALI_SEGMENTS];
+    int idx = raw / CALI_STEP;
+    int frac = raw % CALI_STEP;
+    return t->mv[idx] + (t->mv[idx + 1] - t->mv[idx]) * frac / CALI_STEP;
+}
+
+int adc_read_pin_mv(uint8_t pin) {
+    int ch = adc_ch(pin);
+    if (ch < 0)
+        return -1;
+
+    // streaming is always at ADC_ATTEN
+    int v = stream_last_value(ch);
+    if (v >= 0)
+        return raw_to_mv(get_cali(ADC_ATTEN), v >> (16 - ADC_BITS));
+
+    // start with the attenuation used last time, or the widest range
+    adc_atten_t atten = chan_atten[ch] ? chan_atten[ch] - 1 : ADC_ATTEN_DB_11;
+    int raw = read_raw(ch, atten);
+    if (raw >= ADC_MAX_RAW && atten != ADC_ATTEN_DB_11) {
+        // clipped; the value says nothing about which range fits, so measure at the widest
+        atten = ADC_ATTEN_DB_11;
+        raw = read_raw(ch, atten);
+    }
+    int mv = raw_to_mv(get_cali(atten), raw);
+
+    // pick the narrowest range that fits with some headroom, for better resolution
+    adc_atten_t best = ADC_ATTEN_DB_11;
+    for (int a = 0; a < ADC_ATTEN_DB_11; ++a) {
+        if (mv < get_cali(a)->mv[CALI_SEGMENTS] * 7 / 8) {
+            best = a;
+            break;
+        }
+    }
+    if (best != atten)
+        mv = raw_to_mv(get_cali(best), read_raw(ch, best));
+
+    return mv;
+}
+
+// Continuous (DMA) sampling of several channels.
+// Raw samples are read on a dedicated task, and every `decimation` samples of each channel are
+// reduced to min/max/mean/RMS, which are then passed to the callback on the main task.
+
+#define STREAM_FRAME_SIZE 256
+#define STREAM_BUF_SIZE 4096
+#define STREAM_MAX_CH 8
+
+#if CONFIG_IDF_TARGET_ESP32 || CONFIG_IDF_TARGET_ESP32S2
+#define STREAM_FORMAT ADC_DIGI_OUTPUT_FORMAT_TYPE1
+#define STREAM_CHANNEL(p) ((p)->type1.channel)
+#define STREAM_DATA(p) ((p)->type1.data)
+#else
+#define STREAM_FORMAT ADC_DIGI_OUTPUT_FORMAT_TYPE2
+#define STREAM_CHANNEL(p) ((p)->type2.channel)
+#define STREAM_DATA(p) ((p)->type2.data)
+#endif
+
+#define STREAM_BITS SOC_ADC_DIGI_MAX_BITWIDTH
+
+typedef struct {
+    uint32_t count;
+    uint32_t sum;
+    uint64_t sum_sq;
+    uint16_t min, max;
+} stream_acc_t;
+
+typedef struct {
+    adc_continuous_handle_t handle;
+    adc_stream_cb_t cb;
+    void *userdata;
+    unsigned num_ch;
+    unsigned decimation;
+    uint8_t ch_index[SOC_ADC_MAX_CHANNEL_NUM];
+    stream_acc_t acc[STREAM_MAX_CH];
+    adc_stream_sample_t out[STREAM_MAX_CH];
+    int last_value[STREAM_MAX_CH];
+    bool out_busy;
+    bool read_scheduled;
+    uint32_t num_samples, num_dropped, num_paused, cycles;
+    uint8_t buf[STREAM_FRAME_SIZE];
+} adc_stream_t;
+
+static adc_stream_t *stream;
+static worker_t stream_worker;
+static SemaphoreHandle_t stream_lock;
+
+// -1 if the channel isn't streamed, or there's no result yet
+static int stream_last_value(int ch) {
+    adc_stream_t *s = stream;
+    if (!s || s->ch_index[ch] == 0xff)
+        return -1;
+    return s->last_value[s->ch_index[ch]];
+}
+
+// Oneshot reads of other channels stop the stream for the duration; it just sees a gap.
+static void stream_pause(bool pause) {
+    adc_stream_t *s = stream;
+    if (!s)
+        return;
+    if (pause) {
+        xSemaphoreTake(stream_lock, portMAX_DELAY);
+        adc_continuous_stop(s->handle);
+        s->num_paused++;
+    } else {
+        adc_continuous_start(s->handle);
+        xSemaphoreGive(stream_lock);
+    }
+}
+
+static void stream_deliver(void *arg) {
+    adc_stream_t *s = arg;
+    if (s == stream && s->cb)
+        s->cb(s->out, s->num_ch, s->userdata);
+    s->out_busy = false;
+}
+
+static void stream_emit(adc_stream_t *s) {
+    if (s->out_busy) {
+        // main task didn't pick up the previous result yet
+        s->num_dropped++;
+    } else {
+        for (unsigned i = 0; i < s->num_ch; ++i) {
+            stream_acc_t *a = &s->acc[i];
+            adc_stream_sample_t *o = &s->out[i];
+            if (a->count == 0)
+                continue; // missed this round (eg. after a pause); keep the previous result
+            const int shift = 16 - STREAM_BITS;
+            o->min = a->min << shift;
+            o->max = a->max << shift;
+            o->mean = (a->sum / a->count) << shift;
+            o->rms = (uint16_t)(sqrtf((float)a->sum_sq / a->count) * (1 << shift));
+            s->last_value[i] = o->mean;
+        }
+        // without a callback, only last_value is used
+        if (s->cb) {
+            s->out_busy = true;
+            if (worker_run(main_worker, stream_deliver, s) != 0) {
+                s->out_busy = false;
+                s->num_dropped++;
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < s->num_ch; ++i) {
+        memset(&s->acc[i], 0, sizeof(stream_acc_t));
+        s->acc[i].min = 0xffff;
+    }
+}
+
+static void stream_read(void *arg) {
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    adc_stream_t *s = stream;
+    if (s) {
+        s->read_scheduled = false;
+        uint32_t t0 = esp_cpu_get_cycle_count();
+        uint32_t len;
+        while (adc_continuous_read(s->handle, s->buf, sizeof(s->buf), &len, 0) == ESP_OK) {
+            for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= len;
+                 i += SOC_ADC_DIGI_RESULT_BYTES) {
+                adc_digi_output_data_t *p = (void *)&s->buf[i];
+                unsigned ch = STREAM_CHANNEL(p);
+                if (ch >= SOC_ADC_MAX_CHANNEL_NUM || s->ch_index[ch] == 0xff)
+                    continue;
+                uint16_t v = STREAM_DATA(p);
+                stream_acc_t *a = &s->acc[s->ch_index[ch]];
+                a->count++;
+                a->sum += v;
+                a->sum_sq += v * v;
+                if (v < a->min)
+                    a->min = v;
+                if (v > a->max)
+                    a->max = v;
+                s->num_samples++;
+                // channels are sampled round-robin, so the last one completes the set
+                if (s->ch_index[ch] == s->num_ch - 1 && a->count >= s->decimation)
+                    stream_emit(s);
+            }
+        }
+        s->cycles += esp_cpu_get_cycle_count() - t0;
+    }
+    xSemaphoreGive(stream_lock);
+}
+
+static IRAM_ATTR bool stream_conv_done(adc_continuous_handle_t handle,
+                                       const adc_continuous_evt_data_t *edata, void *user_data) {
+    adc_stream_t *s = user_data;
+    if (!s->read_scheduled) {
+        s->read_scheduled = true;
+        if (worker_run(stream_worker, stream_read, NULL) != 0)
+            s->read_scheduled = false;
+    }
+    return false;
+}
+
+int adc_stream_start(const uint8_t *pins, unsigned num_pins, uint32_t sample_hz,
+                     unsigned decimation, adc_stream_cb_t cb, void *userdata) {
+    if (stream)
+        return -1;
+    if (num_pins == 0 || num_pins > STREAM_MAX_CH || decimation == 0)
+        return -2;
+
+    uint32_t total_hz = sample_hz * num_pins;
+    if (total_hz < SOC_ADC_SAMPLE_FREQ_THRES_LOW || total_hz > SOC_ADC_SAMPLE_FREQ_THRES_HIGH) {
+        LOG("sample rate %u out of range %u-%u", (unsigned)total_hz,
+            SOC_ADC_SAMPLE_FREQ_THRES_LOW, SOC_ADC_SAMPLE_FREQ_THRES_HIGH);
+        return -3;
+    }
+
+    if (!stream_worker) {
+        stream_worker = worker_start("adc", 4096);
+        stream_lock = xSemaphoreCreateMutex();
+    }
+
+    adc_stream_t *s = jd_alloc(sizeof(adc_stream_t));
+    memset(s->ch_index, 0xff, sizeof(s->ch_index));
+    s->cb = cb;
+    s->userdata = userdata;
+    s->num_ch = num_pins;
+    s->decimation = decimation;
+
+    adc_digi_pattern_config_t pattern[STREAM_MAX_CH] = {0};
+    for (unsigned i = 0; i < num_pins; ++i) {
+        int ch = adc_ch(pins[i]);
+        if (ch < 0 || s->ch_index[ch] != 0xff) {
+            jd_free(s);
+            return -2;
+        }
+        s->ch_index[ch] = i;
+        s->acc[i].min = 0xffff;
+        s->last_value[i] = -1;
+        pattern[i].atten = ADC_ATTEN;
+        pattern[i].channel = ch;
+        pattern[i].unit = ADC_UNIT_1;
+        pattern[i].bit_width = STREAM_BITS;
+    }
+
+    adc_continuous_handle_cfg_t handle_cfg = {
+        .max_store_buf_size = STREAM_BUF_SIZE,
+        .conv_frame_size = STREAM_FRAME_SIZE,
+    };
+    esp_err_t err = adc_continuous_new_handle(&handle_cfg, &s->handle);
+    if (err) {
+        LOG("can't create stream: %d", err);
+        jd_free(s);
+        return -4;
+    }
+
+    adc_continuous_config_t dig_cfg = {
+        .pattern_num = num_pins,
+        .adc_pattern = pattern,
+        .sample_freq_hz = total_hz,
+        .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+        .format = STREAM_FORMAT,
+    };
+    err = adc_continuous_config(s->handle, &dig_cfg);
+
+    adc_continuous_evt_cbs_t cbs = {
+        .on_conv_done = stream_conv_done,
+    };
+    if (!err)
+        err = adc_continuous_register_event_callbacks(s->handle, &cbs, s);
+
+    if (!err) {
+        stream = s;
+        err = adc_continuous_start(s->handle);
+        if (err)
+            stream = NULL;
+    }
+
+    if (err) {
+        LOG("can't start stream: %d", err);
+        adc_continuous_deinit(s->handle);
+        jd_free(s);
+        return -4;
+    }
+
+    LOG("streaming %u channels at %u Hz, /%u", num_pins, (unsigned)sample_hz, decimation);
+
+    return 0;
+}
+
+void adc_stream_stop(void) {
+    if (!stream)
+        return;
+
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    adc_stream_t *s = stream;
+    stream = NULL;
+    xSemaphoreGive(stream_lock);
+
+    adc_continuous_stop(s->handle);
+    adc_continuous_deinit(s->handle);
+
+    LOG("stream: %u samples, %u cycles/sample, %u dropped, %u pauses", (unsigned)s->num_samples,
+        (unsigned)(s->num_samples ? s->cycles / s->num_samples : 0), (unsigned)s->num_dropped,
+        (unsigned)s->num_paused);
+
+    // a result may still be on its way to the main task
+    if (s->out_busy)
+        worker_run(main_worker, (TaskFunction_t)jd_free, s);
+    else
+        jd_free(s);
+}
+
+void adc_stream_init(void) {
+    uint8_t pins[STREAM_MAX_CH];
+    unsigned num_pins = 0;
+    char key[32];
+    for (unsigned i = 0; i < STREAM_MAX_CH; ++i) {
+        jd_sprintf(key, sizeof(key), "adc.streamPins.%u", i);
+        uint8_t pin = dcfg_get_pin(key);
+        if (pin == NO_PIN)
+            break;
+        pins[num_pins++] = pin;
+    }
+    if (num_pins == 0)
+        return;
+
+    // no callback; analog services get the decimated means through adc_read_pin()
+    adc_stream_start(pins, num_pins, dcfg_get_i32("adc.streamHz", 20000),
+                     dcfg_get_i32("adc.streamDecimation", 64), NULL, NULL);
 }
 
 #if JD_CONFIG_TEMPERATURE
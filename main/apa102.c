@@ -0,0 +1,139 @@
+#include "jdesp.h"
+#include "esp_heap_caps.h"
+#include <math.h>
+
+// APA102/SK9822 (clocked) LED strips, sent over SPI with DMA.
+// Enabled by setting ledStrip.pinCLK; the data pin is the one passed to devs_led_strip_send().
+
+#define LOG(msg, ...) DMESG("apa102: " msg, ##__VA_ARGS__)
+
+#define APA102_DEFAULT_MHZ 8
+
+static uint8_t *frame;
+static unsigned frame_alloc, frame_size, frame_ptr;
+static cb_t frame_done_fn;
+static bool frame_in_use;
+static uint8_t global_brightness, order[3];
+static uint8_t *gamma_lut;
+
+static void apa102_init(void) {
+    if (global_brightness)
+        return;
+
+    // 5-bit global brightness field (1..31); 0 in config means full brightness
+    int b = dcfg_get_i32("ledStrip.brightness", 0);
+    global_brightness = b == 0 ? 31 : b >> 3;
+    if (global_brightness < 1)
+        global_brightness = 1;
+    if (global_brightness > 31)
+        global_brightness = 31;
+
+    // input is RGB, APA102 expects BGR (after the brightness byte)
+    order[0] = 2;
+    order[1] = 1;
+    order[2] = 0;
+    ledstrip_config_order(order);
+
+    int gamma10 = dcfg_get_i32("ledStrip.gamma10", 0);
+    if (gamma10) {
+        gamma_lut = jd_alloc(256);
+        for (int v = 0; v < 256; ++v)
+            gamma_lut[v] = (uint8_t)(powf(v / 255.0f, gamma10 / 10.0f) * 255 + 0.5f);
+    }
+}
+
+bool apa102_is_enabled(void) {
+    return dcfg_get_pin("ledStrip.pinCLK") != NO_PIN;
+}
+
+static void send_chunk(void);
+
+static void chunk_done(void) {
+    if (frame_ptr < frame_size) {
+        send_chunk();
+    } else {
+        frame_in_use = false;
+        frame_done_fn();
+    }
+}
+
+static void send_chunk(void) {
+    unsigned len = frame_size - frame_ptr;
+    unsigned max = jd_spi_max_block_size();
+    if (len > max)
+        len = max;
+    const uint8_t *p = frame + frame_ptr;
+    frame_ptr += len;
+    int r = jd_spi_xfer(p, NULL, len, chunk_done);
+    if (r) {
+        // the bus is free between chunks, so another SPI user may have taken it; drop the rest
+        LOG("xfer failed: %d", r);
+        frame_ptr = frame_size;
+        tim_worker_run((TaskFunction_t)chunk_done, NULL);
+    }
+}
+
+int apa102_send(uint8_t pin, const uint8_t *data, unsigned size, cb_t donefn) {
+    if (frame_in_use)
+        return -100;
+
+    apa102_init();
+
+    jd_spi_cfg_t cfg = {
+        .miso = NO_PIN,
+        .mosi = pin,
+        .sck = dcfg_get_pin("ledStrip.pinCLK"),
+        .mode = 0,
+        .hz = dcfg_get_i32("ledStrip.clockMHz", APA102_DEFAULT_MHZ) * 1000000,
+    };
+
+    const jd_spi_cfg_t *curr = spi_current_cfg();
+    if (curr && !jd_spi_is_ready())
+        return -100; // SPI busy
+
+    if (!curr || !spi_cfg_equal(curr, &cfg)) {
+        int r = jd_spi_init(&cfg);
+        if (r) {
+            LOG("SPI init failed: %d", r);
+            return r;
+        }
+    }
+
+    unsigned npix = size / 3;
+    // start frame, pixels, SK9822 reset frame, and end frame with a clock edge per two pixels
+    unsigned needed = 4 + npix * 4 + 4 + (npix + 15) / 16;
+    if (frame_alloc < needed) {
+        heap_caps_free(frame);
+        frame = heap_caps_malloc(needed, MALLOC_CAP_DMA);
+        if (!frame) {
+            frame_alloc = 0;
+            LOG("OOM %u", needed);
+            return -101;
+        }
+        frame_alloc = needed;
+    }
+
+    uint8_t *dst = frame;
+    memset(dst, 0, 4);
+    dst += 4;
+    for (unsigned i = 0; i < npix; ++i) {
+        const uint8_t *px = data + i * 3;
+        *dst++ = 0xE0 | global_brightness;
+        for (int j = 0; j < 3; ++j) {
+            uint8_t v = px[order[j]];
+            *dst++ = gamma_lut ? gamma_lut[v] : v;
+        }
+    }
+    memset(dst, 0, 4);
+    dst += 4;
+    memset(dst, 0xff, (npix + 15) / 16);
+    dst += (npix + 15) / 16;
+
+    frame_size = dst - frame;
+    frame_ptr = 0;
+    frame_done_fn = donefn;
+    frame_in_use = true;
+    send_chunk();
+
+    return 0;
+}
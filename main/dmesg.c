@@ -21,7 +21,9 @@ void __wrap_uart_hal_write_txfifo(void *hal, const uint8_t *buf, uint32_t data_s
 
 // void __real_panic_restart(void);
 void __wrap_panic_restart(void) {
+    sdcache_panic_begin(); // lstore flush goes through the cache
     jd_lstore_panic_flush();
+    sdcache_panic_flush();
     jd_usb_panic_print_char('\n');
     target_reset(); // this make sure to reset USB connection state on ESP32-C3
     // __real_panic_restart();
@@ -43,6 +45,7 @@ void panic_dump_dmesg(void) {
 void __real_esp_panic_handler(void *);
 void __wrap_esp_panic_handler(void *info) {
     panic_mode_uart = 1;
+    rtclog_panic();
     jd_usb_panic_start();
     panic_dump_dmesg();
     __real_esp_panic_handler(info);
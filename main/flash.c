@@ -2,39 +2,479 @@
 #include "esp_partition.h"
 #include "esp_flash.h"
 #include "spi_flash_mmap.h"
+#include "nvs_flash.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+
+// jd_fstor on top of this is already log-structured (CRC-checked records, compaction into
+// fresh pages), so this layer only avoids redundant work and keeps track of wear:
+// erasing blank pages and re-writing identical data is skipped, writes are verified,
+// and per-page erase counts are kept in NVS (saved lazily from flash_sync()).
+// A write that fails verification is retried, then redone on a freshly erased page (keeping
+// the rest of the page); if that fails too, it's only logged, and jd_fstor's CRCs take over.
+
+#define WEAR_NVS_NAMESPACE "jd"
+#define WEAR_NVS_KEY "fstor_wear"
+// don't wear out NVS itself
+#define WEAR_SAVE_INTERVAL_US (60 * 1000000)
 
 uint32_t flash_size, flash_base;
-int32_t flash_offset;
 
-void flash_init(void) {
-    const esp_partition_t *part = esp_partition_find_first(0x8A, 0x01, NULL);
-    JD_ASSERT(part != NULL);
-    JD_ASSERT((part->address & 0xffff) == 0);
-    JD_ASSERT((part->size & (JD_FLASH_PAGE_SIZE - 1)) == 0);
+static uint16_t *erase_counts;
+static unsigned num_pages;
+static bool wear_dirty;
+static int64_t wear_last_save;
+static uint32_t num_erases, num_erase_skipped, num_writes, num_write_skipped, num_verify_failed;
+// longest single erase/write call, i.e., how long the cache (and non-IRAM code) may be stalled
+static uint32_t max_stall_us;
 
-    const void *rd_part;
-    spi_flash_mmap_handle_t map;
-    CHK(spi_flash_mmap(part->address, part->size, SPI_FLASH_MMAP_DATA, &rd_part, &map));
+#define FLASH_STALL_LOG_US 10000
+
+// fstor slots are partitions of type 0x8A with subtypes 0x01, 0x02, ...; see boards/partitions*.csv
+// Several slots need a build with JD_FSTOR_SHARED_KB (FSTOR_SHARED_KB in Makefile.user); otherwise
+// only slot 0 is used.
+// jd_fstor keeps settings in its first JD_FSTOR_MAX_DATA_PAGES pages, and the program image after
+// them. The settings part always comes from slot 0, so it's shared; only the program part is per
+// slot. jd_fstor sees both mapped next to each other.
+// A deploy (devsmgr_deploy_start(), wrapped) switches the program part to the next slot, on
+// probation: unless fstor_slot_confirm() is called (automatically once the VM has been running
+// for fstor.confirmS seconds) within fstor.trialBoots boots, the previous slot is restored.
+#ifdef JD_FSTOR_SHARED_KB
+#define FSTOR_SHARED_SIZE (JD_FSTOR_SHARED_KB * 1024)
+_Static_assert(FSTOR_SHARED_SIZE % SPI_FLASH_MMU_PAGE_SIZE == 0, "shared fstor part unaligned");
+_Static_assert(FSTOR_SHARED_SIZE == JD_FSTOR_MAX_DATA_PAGES * JD_FLASH_PAGE_SIZE,
+               "settings don't match the shared part");
+#define FSTOR_MAX_SLOTS 4
+#else
+#define FSTOR_SHARED_SIZE 0
+#define FSTOR_MAX_SLOTS 1
+#endif
+
+#define FSTOR_TRIAL_MAGIC 0x5f8e2c71
+#define FSTOR_DEFAULT_TRIAL_BOOTS 3
+#define FSTOR_DEFAULT_CONFIRM_S 30
+
+typedef struct {
+    uint32_t magic;
+    uint32_t boots;
+} fstor_trial_t;
+
+static RTC_NOINIT_ATTR fstor_trial_t fstor_trial;
+static const esp_partition_t *fstor_slots[FSTOR_MAX_SLOTS];
+static uint8_t active_slot;
+static bool nvs_ok;
+static bool confirm_pending, vm_running;
+static esp_timer_handle_t confirm_timer;
+static spi_flash_mmap_handle_t fstor_map;
+
+static void nvs_init(void) {
+    esp_err_t r = nvs_flash_init();
+    if (r == ESP_ERR_NVS_NO_FREE_PAGES || r == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        DMESG("flash: erasing NVS (%d)", r);
+        r = nvs_flash_erase();
+        if (r == ESP_OK)
+            r = nvs_flash_init();
+    }
+    if (r != ESP_OK)
+        DMESG("! flash: NVS init failed: %d", r);
+    nvs_ok = r == ESP_OK;
+}
+
+static uint8_t nvs_get(const char *key, uint8_t defl) {
+    nvs_handle_t h;
+    uint8_t v = defl;
+    if (nvs_ok && nvs_open(WEAR_NVS_NAMESPACE, NVS_READONLY, &h) == ESP_OK) {
+        if (nvs_get_u8(h, key, &v) != ESP_OK)
+            v = defl;
+        nvs_close(h);
+    }
+    return v;
+}
+
+static void nvs_set(const char *key, uint8_t v) {
+    nvs_handle_t h;
+    if (nvs_ok && nvs_open(WEAR_NVS_NAMESPACE, NVS_READWRITE, &h) == ESP_OK) {
+        if (nvs_set_u8(h, key, v) == ESP_OK)
+            nvs_commit(h);
+        nvs_close(h);
+    }
+}
+
+static void wear_key(char *buf, unsigned size) {
+    // slot 0 uses the same key as before multiple slots
+    if (active_slot == 0)
+        strlcpy(buf, WEAR_NVS_KEY, size);
+    else
+        snprintf(buf, size, WEAR_NVS_KEY "%d", active_slot);
+}
+
+static void wear_load(void) {
+    num_pages = flash_size / JD_FLASH_PAGE_SIZE;
+    if (!erase_counts)
+        erase_counts = jd_alloc(num_pages * sizeof(uint16_t));
+
+    nvs_handle_t h;
+    if (!nvs_ok || nvs_open(WEAR_NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK) {
+        DMESG("flash: no NVS for wear stats");
+        return;
+    }
+    char key[16];
+    wear_key(key, sizeof(key));
+    size_t sz = num_pages * sizeof(uint16_t);
+    if (nvs_get_blob(h, key, erase_counts, &sz) != ESP_OK ||
+        sz != num_pages * sizeof(uint16_t))
+        memset(erase_counts, 0, num_pages * sizeof(uint16_t));
+    nvs_close(h);
+
+    unsigned max = 0, total = 0;
+    for (unsigned i = 0; i < num_pages; ++i) {
+        total += erase_counts[i];
+        if (erase_counts[i] > max)
+            max = erase_counts[i];
+    }
+    DMESG("flash: %u erases so far, max %u per page", total, max);
+}
+
+static void wear_save(void) {
+    nvs_handle_t h;
+    if (!nvs_ok || nvs_open(WEAR_NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK)
+        return;
+    char key[16];
+    wear_key(key, sizeof(key));
+    if (nvs_set_blob(h, key, erase_counts, num_pages * sizeof(uint16_t)) == ESP_OK)
+        nvs_commit(h);
+    nvs_close(h);
+    wear_dirty = false;
+
+    unsigned max = 0, max_page = 0;
+    for (unsigned i = 0; i < num_pages; ++i)
+        if (erase_counts[i] > max) {
+            max = erase_counts[i];
+            max_page = i;
+        }
+    DMESG("flash: %u erases (%u skipped), %u writes (%u skipped, %u failed), max %u on page %u, "
+          "max stall %uus",
+          (unsigned)num_erases, (unsigned)num_erase_skipped, (unsigned)num_writes,
+          (unsigned)num_write_skipped, (unsigned)num_verify_failed, max, max_page,
+          (unsigned)max_stall_us);
+}
+
+static bool is_blank(const void *addr, uint32_t len) {
+    const uint32_t *p = addr;
+    for (unsigned i = 0; i < len / 4; ++i)
+        if (p[i] != 0xffffffff)
+            return false;
+    return true;
+}
+
+void fstor_slot_confirm(void) {
+    confirm_pending = false;
+    if (nvs_get("fstor_trial", 0)) {
+        nvs_set("fstor_trial", 0);
+        DMESG("fstor: slot %d confirmed", active_slot);
+    }
+    fstor_trial.magic = 0;
+}
+
+static void confirm_timer_cb(void *arg) {
+    // NVS writes are fine from the timer task
+    fstor_slot_confirm();
+}
+
+// (re)starts the confirm countdown if the VM runs; it's stopped whenever the VM does
+static void update_confirm_timer(void) {
+    if (!confirm_timer) {
+        esp_timer_create_args_t args = {
+            .callback = confirm_timer_cb,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "fstor_confirm",
+        };
+        CHK(esp_timer_create(&args, &confirm_timer));
+    } else {
+        esp_timer_stop(confirm_timer);
+    }
+    if (confirm_pending && vm_running) {
+        int64_t us = dcfg_get_i32("fstor.confirmS", FSTOR_DEFAULT_CONFIRM_S) * 1000000LL;
+        CHK(esp_timer_start_once(confirm_timer, us));
+    }
+}
+
+void fstor_vm_running(bool running) {
+    if (vm_running == running)
+        return;
+    vm_running = running;
+    if (confirm_pending)
+        update_confirm_timer();
+}
+
+static void find_slots(void) {
+    esp_partition_iterator_t it = esp_partition_find(0x8A, ESP_PARTITION_SUBTYPE_ANY, NULL);
+    for (; it; it = esp_partition_next(it)) {
+        const esp_partition_t *p = esp_partition_get(it);
+        if (p->subtype >= 1 && p->subtype <= FSTOR_MAX_SLOTS)
+            fstor_slots[p->subtype - 1] = p;
+    }
+    esp_partition_iterator_release(it);
+
+    const esp_partition_t *p0 = fstor_slots[0];
+    JD_ASSERT(p0 != NULL);
+    JD_ASSERT((p0->address & (SPI_FLASH_MMU_PAGE_SIZE - 1)) == 0);
+    JD_ASSERT((p0->size & (SPI_FLASH_MMU_PAGE_SIZE - 1)) == 0);
+    for (int i = 1; i < FSTOR_MAX_SLOTS; ++i) {
+        const esp_partition_t *p = fstor_slots[i];
+        // slots share the settings part of slot 0, so they have to be the same size
+        if (p && (p->size != p0->size || p0->size <= FSTOR_SHARED_SIZE ||
+                  (p->address & (SPI_FLASH_MMU_PAGE_SIZE - 1)))) {
+            DMESG("! fstor: slot %d doesn't match slot 0; ignoring", i);
+            fstor_slots[i] = NULL;
+        }
+    }
+}
+
+static void select_slot(void) {
+    find_slots();
+
+    active_slot = nvs_get("fstor_slot", 0);
+
+    if (nvs_get("fstor_trial", 0)) {
+        if (fstor_trial.magic != FSTOR_TRIAL_MAGIC) {
+            fstor_trial.magic = FSTOR_TRIAL_MAGIC;
+            fstor_trial.boots = 0;
+        }
+        fstor_trial.boots++;
+        if (fstor_trial.boots > dcfg_get_i32("fstor.trialBoots", FSTOR_DEFAULT_TRIAL_BOOTS)) {
+            uint8_t prev = nvs_get("fstor_prev", 0);
+            DMESG("fstor: slot %d not confirmed, rolling back to %d", active_slot, prev);
+            active_slot = prev;
+            nvs_set("fstor_slot", prev);
+            nvs_set("fstor_trial", 0);
+            fstor_trial.magic = 0;
+        } else {
+            confirm_pending = true;
+        }
+    }
+
+    if (active_slot >= FSTOR_MAX_SLOTS || !fstor_slots[active_slot]) {
+        DMESG("fstor: no slot %d", active_slot);
+        active_slot = 0;
+    }
+}
 
-    flash_size = part->size;
+static unsigned fstor_num_slots(void) {
+    unsigned n = 0;
+    while (n < FSTOR_MAX_SLOTS && fstor_slots[n])
+        n++;
+    return n;
+}
+
+// physical address of given offset in the fstor view of a slot
+static uint32_t slot_addr(unsigned slot, uint32_t offset) {
+    const esp_partition_t *p = offset < FSTOR_SHARED_SIZE ? fstor_slots[0] : fstor_slots[slot];
+    return p->address + offset;
+}
+
+static void map_slot(unsigned slot) {
+    unsigned n = flash_size / SPI_FLASH_MMU_PAGE_SIZE;
+    int *pages = jd_alloc(n * sizeof(int));
+    for (unsigned i = 0; i < n; ++i)
+        pages[i] = slot_addr(slot, i * SPI_FLASH_MMU_PAGE_SIZE) / SPI_FLASH_MMU_PAGE_SIZE;
+    const void *rd_part;
+    CHK(spi_flash_mmap_pages(pages, n, SPI_FLASH_MMAP_DATA, &rd_part, &fstor_map));
+    jd_free(pages);
     flash_base = (uint32_t)rd_part;
-    flash_offset = part->address - flash_base;
+}
 
-    DMESG("fstor at %x -> %p (%ukB)", (unsigned)part->address, rd_part,
-          (unsigned)(flash_size >> 10));
+// re-map the fstor view to given slot at the current address; false if it landed elsewhere
+static bool remap_slot(unsigned slot) {
+    uint32_t prev_base = flash_base;
+    spi_flash_munmap(fstor_map);
+    map_slot(slot);
+    return flash_base == prev_base;
+}
+
+void fstor_deploy_begin(void) {
+    unsigned n = fstor_num_slots();
+    // a deploy on probation (not confirmed yet) goes to the same slot, so that the previous
+    // (known good) one is kept
+    if (n < 2 || nvs_get("fstor_trial", 0))
+        return;
+
+    uint8_t prev = active_slot;
+    uint8_t next = (active_slot + 1) % n;
+
+    if (wear_dirty)
+        wear_save();
+
+    // This runs on the main task, like the VM, which devsmgr_deploy_start() stops right after,
+    // so nothing reads the old image from here on. Nothing else unmaps flash, so the MMU pages
+    // just freed get reused and the address stays the same; pointers into fstor (held by
+    // jd_fstor and devsmgr) depend on that.
+    if (!remap_slot(next)) {
+        DMESG("! fstor: slot %d mapped elsewhere; deploying to slot %d", next, prev);
+        if (!remap_slot(prev)) {
+            DMESG("! fstor: can't restore mapping; rebooting");
+            esp_restart();
+        }
+        return;
+    }
+
+    DMESG("fstor: deploying to slot %d", next);
+
+    nvs_set("fstor_prev", prev);
+    nvs_set("fstor_slot", next);
+    nvs_set("fstor_trial", 1);
+    fstor_trial.magic = 0;
+    active_slot = next;
+
+    // erase counts of the shared part carry over
+    unsigned shared = FSTOR_SHARED_SIZE / JD_FLASH_PAGE_SIZE;
+    uint16_t *shared_counts = jd_alloc(shared * sizeof(uint16_t));
+    memcpy(shared_counts, erase_counts, shared * sizeof(uint16_t));
+    wear_load();
+    memcpy(erase_counts, shared_counts, shared * sizeof(uint16_t));
+    jd_free(shared_counts);
+
+    // the VM has to start again (and stay up) with the new image
+    confirm_pending = true;
+    update_confirm_timer();
+}
+
+int __real_devsmgr_deploy_start(uint32_t sz);
+int __wrap_devsmgr_deploy_start(uint32_t sz) {
+    fstor_deploy_begin();
+    return __real_devsmgr_deploy_start(sz);
+}
+
+void flash_init(void) {
+    nvs_init();
+
+    select_slot();
+
+    flash_size = fstor_slots[active_slot]->size;
+    map_slot(active_slot);
+
+    DMESG("fstor slot %d/%u at %x -> %p (%ukB)", active_slot, fstor_num_slots(),
+          (unsigned)slot_addr(active_slot, 0), (void *)flash_base, (unsigned)(flash_size >> 10));
+
+    wear_load();
 }
 
 static uint32_t flash_addr(void *addr) {
-    JD_ASSERT(flash_offset != 0);
-    return (uint32_t)addr + flash_offset;
+    uint32_t offset = (uint32_t)addr - flash_base;
+    JD_ASSERT(flash_base != 0 && offset < flash_size);
+    return slot_addr(active_slot, offset);
+}
+
+static void note_stall(int64_t t0) {
+    uint32_t d = esp_timer_get_time() - t0;
+    if (d > max_stall_us) {
+        max_stall_us = d;
+        if (d > FLASH_STALL_LOG_US)
+            DMESG("flash: new max stall %uus", (unsigned)d);
+    }
+}
+
+static void count_erase(void *page_addr) {
+    num_erases++;
+    unsigned page = ((uint32_t)page_addr - flash_base) / JD_FLASH_PAGE_SIZE;
+    if (page < num_pages && erase_counts[page] < 0xffff) {
+        erase_counts[page]++;
+        wear_dirty = true;
+    }
+}
+
+static esp_err_t do_erase(void *page_addr) {
+    if (is_blank(page_addr, JD_FLASH_PAGE_SIZE)) {
+        num_erase_skipped++;
+        return ESP_OK;
+    }
+
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t r = esp_flash_erase_region(NULL, flash_addr(page_addr), JD_FLASH_PAGE_SIZE);
+    note_stall(t0);
+    if (r)
+        return r;
+    count_erase(page_addr);
+    return ESP_OK;
+}
+
+static esp_err_t do_program(void *dst, const void *src, uint32_t len) {
+    if (memcmp(dst, src, len) == 0) {
+        num_write_skipped++;
+        return ESP_OK;
+    }
+
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t r = esp_flash_write(NULL, src, flash_addr(dst), len);
+    note_stall(t0);
+    if (r)
+        return r;
+    num_writes++;
+
+    if (memcmp(dst, src, len) != 0) {
+        // bits can only go 1->0 without erase; anything else is a bug or a failing chip
+        DMESG("! flash verify failed at %p", dst);
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
 }
 
 void flash_erase(void *page_addr) {
-    CHK(esp_flash_erase_region(NULL, flash_addr(page_addr), JD_FLASH_PAGE_SIZE));
+    CHK(do_erase(page_addr));
+}
+
+// erase the page holding dst and write it back with src merged in
+static esp_err_t rewrite_page(void *dst, const void *src, uint32_t len) {
+    uint32_t offset = ((uint32_t)dst - flash_base) & (JD_FLASH_PAGE_SIZE - 1);
+    if (offset + len > JD_FLASH_PAGE_SIZE)
+        return ESP_ERR_INVALID_SIZE;
+    void *page_addr = (uint8_t *)dst - offset;
+
+    uint8_t *buf = jd_alloc(JD_FLASH_PAGE_SIZE);
+    memcpy(buf, page_addr, JD_FLASH_PAGE_SIZE);
+    memcpy(buf + offset, src, len);
+
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t r = esp_flash_erase_region(NULL, flash_addr(page_addr), JD_FLASH_PAGE_SIZE);
+    if (r == ESP_OK) {
+        count_erase(page_addr);
+        r = esp_flash_write(NULL, buf, flash_addr(page_addr), JD_FLASH_PAGE_SIZE);
+    }
+    note_stall(t0);
+    if (r == ESP_OK && memcmp(page_addr, buf, JD_FLASH_PAGE_SIZE) != 0)
+        r = ESP_ERR_INVALID_STATE;
+
+    jd_free(buf);
+    return r;
 }
 
 void flash_program(void *dst, const void *src, uint32_t len) {
-    CHK(esp_flash_write(NULL, src, flash_addr(dst), len));
+    esp_err_t r = do_program(dst, src, len);
+    if (r == ESP_ERR_INVALID_STATE) {
+        // verify failed; could be a transient glitch, so try once more
+        r = do_program(dst, src, len);
+        if (r == ESP_ERR_INVALID_STATE) {
+            DMESG("flash: re-erasing page at %p", dst);
+            r = rewrite_page(dst, src, len);
+        }
+        if (r != ESP_OK) {
+            // a failing chip shouldn't turn into a reboot loop; jd_fstor will see a bad CRC
+            DMESG("! flash: write at %p failed: %d", dst, r);
+            num_verify_failed++;
+            wear_dirty = true;
+            return;
+        }
+    }
+    CHK(r);
 }
 
-void flash_sync(void) {}
+void flash_sync(void) {
+    if (!wear_dirty)
+        return;
+    int64_t now = esp_timer_get_time();
+    if (now - wear_last_save < WEAR_SAVE_INTERVAL_US)
+        return;
+    wear_last_save = now;
+    wear_save();
+}
@@ -0,0 +1,119 @@
+#include "jdesp.h"
+#include "devs_internal.h"
+
+#if JD_HOTPAGES
+
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+
+// Sampling profiler for DeviceScript bytecode: every JD_HOTPAGES_US the current program counter
+// is recorded in a histogram of HOTPAGES_BUCKET-sized chunks of the image. The histogram is
+// dumped (and cleared) periodically; use scripts/hotpages.js to rank the chunks.
+// The sampler runs on the timer task, concurrently with the VM. devs_free_ctx() is wrapped (see
+// CMakeLists.txt) to take ctx_lock, which the main task then holds until jd_process_everything()
+// returns, i.e., until devsmgr has dropped the freed context. The sampler only looks at the
+// context with the lock held, so it never sees one that is being (or has been) freed.
+
+#ifndef JD_HOTPAGES_US
+#define JD_HOTPAGES_US 1000
+#endif
+#define HOTPAGES_BUCKET 256
+#define HOTPAGES_MAX_IMG (256 * 1024)
+#define HOTPAGES_NUM (HOTPAGES_MAX_IMG / HOTPAGES_BUCKET)
+#define HOTPAGES_DUMP_US (30 * 1000000)
+#define HOTPAGES_LINES_PER_LOOP 16
+
+static uint16_t counts[HOTPAGES_NUM];
+static uint32_t num_samples, num_idle;
+static uint32_t ctx_seq_no;
+static esp_timer_handle_t sample_timer;
+static int64_t next_dump;
+static int dump_ptr = -1;
+static SemaphoreHandle_t ctx_lock;
+static bool ctx_locked; // main task only
+
+void __real_devs_free_ctx(devs_ctx_t *ctx);
+void __wrap_devs_free_ctx(devs_ctx_t *ctx) {
+    // released in hotpages_process(), once the pointer to ctx is gone
+    if (ctx_lock && !ctx_locked) {
+        xSemaphoreTake(ctx_lock, portMAX_DELAY);
+        ctx_locked = true;
+    }
+    __real_devs_free_ctx(ctx);
+}
+
+static void sample(void *arg) {
+    // if the context is being freed, skip the sample rather than wait for it
+    if (xSemaphoreTake(ctx_lock, 0) != pdTRUE)
+        return;
+    // the VM keeps running; a torn sample (pc of a frame just returned from) now and then is fine
+    devs_ctx_t *ctx = devsmgr_get_ctx();
+    if (!ctx || !ctx->curr_fn) {
+        num_idle++;
+    } else if (ctx->ctx_seq_no == ctx_seq_no) {
+        // otherwise, new program; histogram cleared on next dump
+        unsigned b = ctx->curr_fn->pc / HOTPAGES_BUCKET;
+        if (b < HOTPAGES_NUM && counts[b] < 0xffff)
+            counts[b]++;
+        num_samples++;
+    }
+    xSemaphoreGive(ctx_lock);
+}
+
+void hotpages_process(void) {
+    if (ctx_locked) {
+        ctx_locked = false;
+        xSemaphoreGive(ctx_lock);
+    }
+
+    if (!sample_timer) {
+        ctx_lock = xSemaphoreCreateMutex();
+        esp_timer_create_args_t args = {
+            .callback = sample,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "hotpages",
+        };
+        CHK(esp_timer_create(&args, &sample_timer));
+        CHK(esp_timer_start_periodic(sample_timer, JD_HOTPAGES_US));
+        next_dump = esp_timer_get_time() + HOTPAGES_DUMP_US;
+    }
+
+    devs_ctx_t *ctx = devsmgr_get_ctx();
+    if (ctx && ctx->ctx_seq_no != ctx_seq_no && dump_ptr < 0) {
+        memset(counts, 0, sizeof(counts));
+        num_samples = num_idle = 0;
+        ctx_seq_no = ctx->ctx_seq_no;
+    }
+
+    if (dump_ptr < 0) {
+        if (esp_timer_get_time() < next_dump || !num_samples)
+            return;
+        printf("HP-START %u %u %u\n", HOTPAGES_BUCKET, (unsigned)num_samples,
+               (unsigned)num_idle);
+        dump_ptr = 0;
+    }
+
+    for (int n = 0; n < HOTPAGES_LINES_PER_LOOP && dump_ptr < HOTPAGES_NUM; dump_ptr++) {
+        if (counts[dump_ptr]) {
+            printf("HP %u %u\n", dump_ptr * HOTPAGES_BUCKET, counts[dump_ptr]);
+            n++;
+        }
+    }
+
+    if (dump_ptr >= HOTPAGES_NUM) {
+        printf("HP-END\n");
+        memset(counts, 0, sizeof(counts));
+        num_samples = num_idle = 0;
+        dump_ptr = -1;
+        next_dump = esp_timer_get_time() + HOTPAGES_DUMP_US;
+    }
+}
+
+#else
+void __real_devs_free_ctx(devs_ctx_t *ctx);
+void __wrap_devs_free_ctx(devs_ctx_t *ctx) {
+    __real_devs_free_ctx(ctx);
+}
+
+void hotpages_process(void) {}
+#endif
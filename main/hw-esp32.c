@@ -12,6 +12,11 @@
 typedef struct jacdac_ctx {
     uint8_t pin_num;
     uint8_t uart_num;
+    // copied from uart_periph_signal[] and GPIO_PIN_MUX_REG[], which are in flash, so that the
+    // IRAM code can use them while the cache is disabled
+    uint16_t rx_sig, tx_sig;
+    int irq;
+    uint32_t pin_mux_reg;
     volatile bool seen_low;
     bool rx_ended;
     bool in_tx;
@@ -63,7 +68,7 @@ static void init_log_pins(void) {
 #endif
 }
 
-static void log_pin_pulse(int pinid, int numpulses) {
+static IRAM_ATTR void log_pin_pulse(int pinid, int numpulses) {
 #ifdef PIN_LOG_0
     uint32_t mask = pinid == 0 ? 1 << PIN_LOG_0 : 1 << PIN_LOG_1;
     while (numpulses--) {
@@ -90,6 +95,7 @@ static void jd_timer(void *dummy) {
 
 static void jd_timer0(void *dummy) {
     LOG("t0 rx=%d tx=%d fall=%d", context.cb_rx, context.cb_tx, context.cb_fall);
+    TRACE_BEGIN(TRACE_JD_TIMER, 0);
     if (context.cb_rx) {
         context.cb_rx = 0;
         jd_rx_completed(0);
@@ -102,10 +108,13 @@ static void jd_timer0(void *dummy) {
         context.cb_fall = 0;
         jd_line_falling();
     }
+    TRACE_END(TRACE_JD_TIMER);
 }
 
 static void jd_tim_worker(void *dummy) {
+    TRACE_BEGIN(TRACE_TIM_WORKER, 0);
     worker_do_work(context.tim_worker);
+    TRACE_END(TRACE_TIM_WORKER);
 }
 
 int tim_worker_run(TaskFunction_t fn, void *arg) {
@@ -138,7 +147,7 @@ void tim_init(void) {
     context.tim_worker = worker_alloc();
 }
 
-static void schedule_timer0(void) {
+static IRAM_ATTR void schedule_timer0(void) {
     esp_timer_stop(context.timer0);
     esp_timer_start_once(context.timer0, 0);
 }
@@ -172,13 +181,13 @@ static IRAM_ATTR esp_err_t xgpio_set_level(gpio_num_t gpio_num, uint32_t level)
 // #define RX_SIG uart_periph_signal[context.uart_num].rx_sig
 // #define TX_SIG uart_periph_signal[context.uart_num].tx_sig
 
-#define RX_SIG uart_periph_signal[context.uart_num].pins[SOC_UART_RX_PIN_IDX].signal
-#define TX_SIG uart_periph_signal[context.uart_num].pins[SOC_UART_TX_PIN_IDX].signal
+#define RX_SIG context.rx_sig
+#define TX_SIG context.tx_sig
 
 static IRAM_ATTR void pin_rx(void) {
-    PIN_FUNC_SELECT(GPIO_PIN_MUX_REG[context.pin_num], PIN_FUNC_GPIO);
-    REG_SET_BIT(GPIO_PIN_MUX_REG[context.pin_num], FUN_PU);
-    PIN_INPUT_ENABLE(GPIO_PIN_MUX_REG[context.pin_num]);
+    PIN_FUNC_SELECT(context.pin_mux_reg, PIN_FUNC_GPIO);
+    REG_SET_BIT(context.pin_mux_reg, FUN_PU);
+    PIN_INPUT_ENABLE(context.pin_mux_reg);
     gpio_ll_output_disable(&GPIO, context.pin_num);
     gpio_matrix_in(context.pin_num, RX_SIG, 0);
 }
@@ -187,7 +196,7 @@ static IRAM_ATTR void pin_tx(void) {
     gpio_matrix_in(GPIO_FUNC_IN_HIGH, RX_SIG,
                    0); // context.uart_hw
     GPIO.pin[context.pin_num].int_type = GPIO_PIN_INTR_DISABLE;
-    PIN_FUNC_SELECT(GPIO_PIN_MUX_REG[context.pin_num], PIN_FUNC_GPIO);
+    PIN_FUNC_SELECT(context.pin_mux_reg, PIN_FUNC_GPIO);
     xgpio_set_level(context.pin_num, 1);
     gpio_matrix_out(context.pin_num, TX_SIG, 0, 0);
 }
@@ -266,6 +275,10 @@ void uart_init_(void) {
     context.uart_hw = UART_LL_GET_HW(context.uart_num);
 
     context.pin_num = pinnum;
+    context.pin_mux_reg = GPIO_PIN_MUX_REG[pinnum];
+    context.rx_sig = uart_periph_signal[context.uart_num].pins[SOC_UART_RX_PIN_IDX].signal;
+    context.tx_sig = uart_periph_signal[context.uart_num].pins[SOC_UART_TX_PIN_IDX].signal;
+    context.irq = uart_periph_signal[context.uart_num].irq;
 
     // uart_mark_used(context.uart_num, true);
 
@@ -278,8 +291,10 @@ void uart_init_(void) {
                                        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
                                        .source_clk = UART_SCLK_DEFAULT};
     CHK(uart_param_config(context.uart_num, &uart_config));
-    CHK(esp_intr_alloc(uart_periph_signal[context.uart_num].irq, 0, (void (*)(void *))uart_isr,
-                       &context, &context.intr_handle));
+    // keep servicing the bus while flash operations have the cache disabled;
+    // everything uart_isr() calls has to be IRAM_ATTR
+    CHK(esp_intr_alloc(context.irq, ESP_INTR_FLAG_IRAM, (void (*)(void *))uart_isr, &context,
+                       &context.intr_handle));
 
     uart_intr_config_t uart_intr = {.intr_enable_mask = 0,
                                     .rxfifo_full_thresh = UART_FULL_THRESH_DEFAULT,
@@ -318,6 +333,8 @@ static void uart_isr(void *dummy) {
     if (!context.intr_handle)
         return;
 
+    TRACE_BEGIN(TRACE_ISR_JACDAC, 0);
+
     uart_dev_t *uart_reg = context.uart_hw;
 
     uint32_t uart_intr_status = uart_reg->int_st.val;
@@ -356,6 +373,8 @@ static void uart_isr(void *dummy) {
             context.rx_ended = 1;
         }
     }
+
+    TRACE_END(TRACE_ISR_JACDAC);
 }
 
 static IRAM_ATTR NOINLINE_ATTR void probe_and_set(volatile uint32_t *oe, volatile uint32_t *inp,
@@ -398,7 +417,7 @@ int uart_start_tx(const void *data, uint32_t numbytes) {
     }
 
     gpio_matrix_in(GPIO_FUNC_IN_HIGH, RX_SIG, 0); // context.uart_hw
-    PIN_FUNC_SELECT(GPIO_PIN_MUX_REG[context.pin_num], PIN_FUNC_GPIO);
+    PIN_FUNC_SELECT(context.pin_mux_reg, PIN_FUNC_GPIO);
     xgpio_set_level(context.pin_num, 0);
 
     probe_and_set(&GPIO_VAL(enable_w1ts), &GPIO_VAL(in), 1 << context.pin_num);
@@ -468,7 +487,7 @@ void uart_start_rx(void *data, uint32_t maxbytes) {
     }
 }
 
-void uart_disable(void) {
+IRAM_ATTR void uart_disable(void) {
     target_disable_irq();
     context.uart_hw->int_clr.val = context.uart_hw->int_st.val;
     context.uart_hw->int_ena.val = UART_BRK_DET_INT_ENA;
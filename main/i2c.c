@@ -2,10 +2,21 @@
 #include "jd_drivers.h"
 #include "driver/i2c.h"
 #include "hal/i2c_hal.h"
+#include "esp_timer.h"
+#include "esp_system.h"
 
 static int i2c_inst_num;
+static uint32_t i2c_cfg_hash;
 
 static uint8_t i2c_ok;
+static uint32_t sync_max_us;
+
+// Sync transfers run on the main loop. A background batch (see below) holds the bus for at
+// most one command link of I2C_BATCH_MAX ops (a few ms at 100kHz), so sync transfers wait for
+// it; the timeout only matters when the bus is stuck.
+#define I2C_SYNC_TIMEOUT_MS 60
+// log sync transfers blocking the main loop for longer than this (once per new maximum)
+#define I2C_SYNC_LOG_US 5000
 
 int i2c_init_(void) {
     uint8_t sda, scl;
@@ -40,6 +51,7 @@ int i2c_init_(void) {
     JD_CHK(i2c_driver_install(i2c_inst_num, conf.mode, 0, 0, 0));
 
     i2c_ok = 1;
+    i2c_cfg_hash = sda | scl << 8 | i2c_inst_num << 16 | (uint32_t)khz << 20;
 
     DMESG("i2c OK: sda=%d scl=%d %dkHz", sda, scl, khz);
 
@@ -48,9 +60,26 @@ int i2c_init_(void) {
 
 #define I2C_TRANS_BUF_MINIMUM_SIZE 200
 
+static void note_result(uint8_t addr, esp_err_t err);
+static bool scan_skip(uint8_t addr);
+
+static esp_err_t sync_cmd_begin(i2c_cmd_handle_t handle) {
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t err = i2c_master_cmd_begin(i2c_inst_num, handle, pdMS_TO_TICKS(I2C_SYNC_TIMEOUT_MS));
+    uint32_t us = esp_timer_get_time() - t0;
+    if (us > sync_max_us) {
+        sync_max_us = us;
+        if (us > I2C_SYNC_LOG_US)
+            DMESG("i2c: sync transfer blocked main loop for %uus", (unsigned)us);
+    }
+    return err;
+}
+
 int i2c_read_ex(uint8_t device_address, void *dst, unsigned len) {
     if (!i2c_ok)
         return -108;
+    if (scan_skip(device_address))
+        return ESP_FAIL; // known to be absent; same as a NACK
 
     esp_err_t err = ESP_OK;
     uint8_t buffer[I2C_TRANS_BUF_MINIMUM_SIZE] = {0};
@@ -72,10 +101,11 @@ int i2c_read_ex(uint8_t device_address, void *dst, unsigned len) {
 
     i2c_master_stop(handle);
 
-    err = i2c_master_cmd_begin(i2c_inst_num, handle, 2);
+    err = sync_cmd_begin(handle);
 
 end:
     i2c_cmd_link_delete_static(handle);
+    note_result(device_address, err);
     return err;
 }
 
@@ -83,6 +113,8 @@ int i2c_write_ex2(uint8_t device_address, const void *src, unsigned len, const v
                   unsigned len2, bool repeated) {
     if (!i2c_ok)
         return -108;
+    if (scan_skip(device_address))
+        return ESP_FAIL; // known to be absent; same as a NACK
 
     esp_err_t err = ESP_OK;
     uint8_t buffer[I2C_TRANS_BUF_MINIMUM_SIZE] = {0};
@@ -111,9 +143,284 @@ int i2c_write_ex2(uint8_t device_address, const void *src, unsigned len, const v
     if (!repeated)
         i2c_master_stop(handle);
 
-    err = i2c_master_cmd_begin(i2c_inst_num, handle, 2);
+    err = sync_cmd_begin(handle);
 
 end:
     i2c_cmd_link_delete_static(handle);
+    note_result(device_address, err);
     return err;
 }
+
+// Asynchronous transactions, executed on a dedicated task so that the main loop isn't blocked
+// for the duration of the transfer. All ops of a batch (up to I2C_BATCH_MAX at a time) are
+// put in a single command link, using repeated starts between them, so several sensors
+// can be polled with one bus acquisition.
+
+#define I2C_BATCH_MAX 8
+#define I2C_BATCH_TIMEOUT_MS 50
+
+typedef struct {
+    i2c_op_t *ops;
+    unsigned num_ops;
+    i2c_done_cb_t done_fn;
+    void *userdata;
+} i2c_batch_t;
+
+static worker_t i2c_worker;
+
+static esp_err_t add_op(i2c_cmd_handle_t h, const i2c_op_t *op) {
+    esp_err_t err = ESP_OK;
+    // with neither wlen nor rlen, it's just an address probe
+    if (op->wlen || !op->rlen) {
+        if (!err)
+            err = i2c_master_start(h);
+        if (!err)
+            err = i2c_master_write_byte(h, op->addr << 1 | I2C_MASTER_WRITE, true);
+        if (!err && op->wlen)
+            err = i2c_master_write(h, op->wbuf, op->wlen, true);
+    }
+    if (op->rlen) {
+        if (!err)
+            err = i2c_master_start(h);
+        if (!err)
+            err = i2c_master_write_byte(h, op->addr << 1 | I2C_MASTER_READ, true);
+        if (!err)
+            err = i2c_master_read(h, op->rbuf, op->rlen, I2C_MASTER_LAST_NACK);
+    }
+    return err;
+}
+
+static esp_err_t run_ops(const i2c_op_t *ops, unsigned num_ops) {
+    uint8_t buffer[I2C_LINK_RECOMMENDED_SIZE(2 * I2C_BATCH_MAX)];
+    i2c_cmd_handle_t handle = i2c_cmd_link_create_static(buffer, sizeof(buffer));
+    JD_ASSERT(handle != NULL);
+
+    esp_err_t err = ESP_OK;
+    for (unsigned i = 0; i < num_ops && !err; ++i)
+        err = add_op(handle, &ops[i]);
+    if (!err)
+        err = i2c_master_stop(handle);
+    if (!err)
+        err = i2c_master_cmd_begin(i2c_inst_num, handle, pdMS_TO_TICKS(I2C_BATCH_TIMEOUT_MS));
+
+    i2c_cmd_link_delete_static(handle);
+    return err;
+}
+
+static void batch_done(void *arg) {
+    i2c_batch_t *b = arg;
+    b->done_fn(b->ops, b->num_ops, b->userdata);
+    jd_free(b);
+}
+
+static void run_batch(void *arg) {
+    i2c_batch_t *b = arg;
+
+    for (unsigned i = 0; i < b->num_ops; i += I2C_BATCH_MAX) {
+        i2c_op_t *ops = b->ops + i;
+        unsigned n = b->num_ops - i;
+        if (n > I2C_BATCH_MAX)
+            n = I2C_BATCH_MAX;
+        esp_err_t err = run_ops(ops, n);
+        for (unsigned j = 0; j < n; ++j)
+            ops[j].status = err;
+        // one NACK fails the whole link; re-run individually to find out which op failed
+        if (err && n > 1)
+            for (unsigned j = 0; j < n; ++j)
+                ops[j].status = run_ops(&ops[j], 1);
+    }
+
+    while (worker_run_wait(main_worker, batch_done, b) != 0)
+        ;
+}
+
+int i2c_queue_batch(i2c_op_t *ops, unsigned num_ops, i2c_done_cb_t done_fn, void *userdata) {
+    if (!i2c_ok)
+        return -108;
+
+    JD_ASSERT(num_ops > 0 && done_fn != NULL);
+
+    if (!i2c_worker)
+        i2c_worker = worker_start("i2c", 4096);
+
+    i2c_batch_t *b = jd_alloc(sizeof(i2c_batch_t));
+    b->ops = ops;
+    b->num_ops = num_ops;
+    b->done_fn = done_fn;
+    b->userdata = userdata;
+
+    if (worker_run(i2c_worker, run_batch, b) != 0) {
+        jd_free(b);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Presence tracking.
+// Results of the boot scan (jd_scan_all()) are kept in settings. Afterwards, all addresses seen
+// during the scan are re-probed in the background, one at a time, to detect hot-plug.
+// A change needs I2C_DEBOUNCE consecutive results (devices may NACK while busy) before it's
+// reported and saved. Re-probing slows down while nothing changes.
+// Since the cache is kept up to date while running, the boot scan skips addresses it has as
+// absent (answering as if they NACKed). It's only trusted after a software reset, with the same
+// bus config, and for I2C_TRUST_BOOTS boots in a row; otherwise (power-on, where anything may
+// have been plugged in while off), every address goes to the bus.
+
+#define I2C_SCAN_SETTING "i2c_scan"
+#define I2C_REPROBE_MS 1000
+#define I2C_REPROBE_MAX_MS 30000
+#define I2C_DEBOUNCE 3
+#define I2C_TRUST_BOOTS 8
+
+typedef struct {
+    uint32_t cfg_hash;
+    uint32_t trusted_boots;
+    uint32_t probed[4];
+    uint32_t present[4];
+} i2c_scan_cache_t;
+
+#define GET_BIT(arr, a) (((arr)[(a) >> 5] >> ((a)&31)) & 1)
+#define SET_BIT(arr, a, v)                                                                         \
+    ((arr)[(a) >> 5] = ((arr)[(a) >> 5] & ~(1U << ((a)&31))) | ((uint32_t)(v) << ((a)&31)))
+
+static i2c_scan_cache_t scan_cache, scan_curr;
+static bool scan_active, scan_trusted;
+static uint8_t num_skipped;
+static bool trust_changed;
+static esp_timer_handle_t reprobe_timer;
+static uint32_t reprobe_ms = I2C_REPROBE_MS;
+static uint8_t reprobe_addr;
+static uint8_t mismatch[128];
+static i2c_op_t reprobe_op;
+
+static void note_result(uint8_t addr, esp_err_t err) {
+    // only ACK/NACK tell us anything; ignore timeouts etc.
+    if (!scan_active || (err != ESP_OK && err != ESP_FAIL))
+        return;
+    addr &= 0x7f;
+    SET_BIT(scan_curr.probed, addr, 1);
+    if (err == ESP_OK)
+        SET_BIT(scan_curr.present, addr, 1);
+}
+
+static bool scan_skip(uint8_t addr) {
+    addr &= 0x7f;
+    if (!scan_active || !scan_trusted || !GET_BIT(scan_cache.probed, addr) ||
+        GET_BIT(scan_cache.present, addr))
+        return false;
+    num_skipped++;
+    return true;
+}
+
+void i2c_scan_begin(void) {
+    if (jd_settings_get_bin(I2C_SCAN_SETTING, &scan_cache, sizeof(scan_cache)) !=
+            sizeof(scan_cache) ||
+        scan_cache.cfg_hash != i2c_cfg_hash)
+        memset(&scan_cache, 0, sizeof(scan_cache));
+    scan_cache.cfg_hash = i2c_cfg_hash;
+
+    esp_reset_reason_t reason = esp_reset_reason();
+    scan_trusted = scan_cache.trusted_boots < I2C_TRUST_BOOTS &&
+                   (reason == ESP_RST_SW || reason == ESP_RST_PANIC ||
+                    reason == ESP_RST_INT_WDT || reason == ESP_RST_TASK_WDT);
+    uint32_t prev_boots = scan_cache.trusted_boots;
+    scan_cache.trusted_boots = scan_trusted ? prev_boots + 1 : 0;
+    trust_changed = scan_cache.trusted_boots != prev_boots;
+
+    memset(&scan_curr, 0, sizeof(scan_curr));
+    num_skipped = 0;
+    scan_active = true;
+}
+
+static void save_cache(void) {
+    jd_settings_set_bin(I2C_SCAN_SETTING, &scan_cache, sizeof(scan_cache));
+}
+
+static void reprobe_schedule(void) {
+    esp_timer_start_once(reprobe_timer, reprobe_ms * 1000);
+}
+
+static void reprobe_done(i2c_op_t *ops, unsigned num_ops, void *userdata) {
+    uint8_t addr = ops->addr;
+    if (ops->status == ESP_OK || ops->status == ESP_FAIL) {
+        bool present = ops->status == ESP_OK;
+        if (GET_BIT(scan_cache.present, addr) == present) {
+            mismatch[addr] = 0;
+        } else {
+            reprobe_ms = I2C_REPROBE_MS;
+            if (++mismatch[addr] >= I2C_DEBOUNCE) {
+                mismatch[addr] = 0;
+                DMESG("i2c: 0x%02x %s", addr, present ? "attached" : "detached");
+                SET_BIT(scan_cache.present, addr, present);
+                save_cache();
+            }
+        }
+    }
+    reprobe_schedule();
+}
+
+static void reprobe_next(void *arg) {
+    int addr = -1;
+
+    // re-check addresses with an unconfirmed change first
+    for (int i = 0; i < 128; ++i)
+        if (mismatch[i]) {
+            addr = i;
+            break;
+        }
+
+    for (int i = 0; addr < 0 && i < 128; ++i) {
+        reprobe_addr = (reprobe_addr + 1) & 0x7f;
+        if (reprobe_addr == 0 && reprobe_ms < I2C_REPROBE_MAX_MS) {
+            // a full round without changes
+            reprobe_ms *= 2;
+            if (reprobe_ms > I2C_REPROBE_MAX_MS)
+                reprobe_ms = I2C_REPROBE_MAX_MS;
+        }
+        if (GET_BIT(scan_cache.probed, reprobe_addr))
+            addr = reprobe_addr;
+    }
+
+    if (addr < 0)
+        return; // nothing to watch
+
+    memset(&reprobe_op, 0, sizeof(reprobe_op));
+    reprobe_op.addr = addr;
+    if (i2c_queue_batch(&reprobe_op, 1, reprobe_done, NULL) != 0)
+        reprobe_schedule();
+}
+
+static void reprobe_timer_cb(void *arg) {
+    if (worker_run(main_worker, reprobe_next, NULL) != 0)
+        reprobe_schedule();
+}
+
+void i2c_scan_end(void) {
+    scan_active = false;
+    if (scan_trusted)
+        DMESG("i2c: scan skipped %d probes of absent addresses", num_skipped);
+
+    bool changed = trust_changed;
+    for (int a = 0; a < 128; ++a)
+        if (GET_BIT(scan_curr.probed, a)) {
+            bool present = GET_BIT(scan_curr.present, a);
+            if (!GET_BIT(scan_cache.probed, a) || GET_BIT(scan_cache.present, a) != present) {
+                if (GET_BIT(scan_cache.probed, a))
+                    DMESG("i2c: 0x%02x %s since last boot", a, present ? "attached" : "detached");
+                SET_BIT(scan_cache.probed, a, 1);
+                SET_BIT(scan_cache.present, a, present);
+                changed = true;
+            }
+        }
+    if (changed)
+        save_cache();
+
+    esp_timer_create_args_t args = {
+        .callback = reprobe_timer_cb,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "i2c_reprobe",
+    };
+    CHK(esp_timer_create(&args, &reprobe_timer));
+    reprobe_schedule();
+}
@@ -0,0 +1,65 @@
+#include "jdesp.h"
+
+#if JD_IRQ_LATENCY
+
+#include "driver/gptimer.h"
+
+// Interrupt latency probe: a hardware timer fires every IRQLAT_PERIOD_US and reloads to 0,
+// so the count read in its ISR is the time from the alarm to the ISR running.
+// The ISR is allocated in IRAM (CONFIG_GPTIMER_ISR_IRAM_SAFE, which the Makefile sets for
+// JD_IRQ_LATENCY builds), like the Jacdac UART ISR, so the figure covers flash erase/write
+// stalls (e.g., during a deploy) as seen by the bus.
+
+#define LOG(msg, ...) DMESG("irqlat: " msg, ##__VA_ARGS__)
+
+#define IRQLAT_PERIOD_US 1000
+#define IRQLAT_SLOW_US 50
+
+static gptimer_handle_t probe_timer;
+static volatile uint32_t max_us, num_slow, num_samples;
+static uint32_t reported_max;
+
+static IRAM_ATTR bool on_alarm(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata,
+                               void *arg) {
+    uint32_t d = edata->count_value;
+    num_samples++;
+    if (d > IRQLAT_SLOW_US)
+        num_slow++;
+    if (d > max_us)
+        max_us = d;
+    return false;
+}
+
+static void start_probe(void) {
+    gptimer_config_t cfg = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = 1000000,
+    };
+    CHK(gptimer_new_timer(&cfg, &probe_timer));
+    gptimer_event_callbacks_t cbs = {.on_alarm = on_alarm};
+    CHK(gptimer_register_event_callbacks(probe_timer, &cbs, NULL));
+    gptimer_alarm_config_t alarm = {
+        .alarm_count = IRQLAT_PERIOD_US,
+        .reload_count = 0,
+        .flags.auto_reload_on_alarm = true,
+    };
+    CHK(gptimer_set_alarm_action(probe_timer, &alarm));
+    CHK(gptimer_enable(probe_timer));
+    CHK(gptimer_start(probe_timer));
+}
+
+void irqlat_process(void) {
+    if (!probe_timer)
+        start_probe();
+    uint32_t m = max_us;
+    if (m > reported_max) {
+        reported_max = m;
+        LOG("new max %uus; %u of %u samples over %uus", (unsigned)m, (unsigned)num_slow,
+            (unsigned)num_samples, IRQLAT_SLOW_US);
+    }
+}
+
+#else
+void irqlat_process(void) {}
+#endif
@@ -56,6 +56,36 @@ const void *dcfg_base_addr(void);
 #define _JD_SECTION_ATTR_IMPL(SECTION, COUNTER)                                                    \
     __attribute__((section(SECTION "." _JD_COUNTER_STRINGIFY(COUNTER))))
 
+// record begin/end trace events; see main/trace.c
+#ifndef JD_TRACE_EVENTS
+#define JD_TRACE_EVENTS 0
+#endif
+
+// sample DeviceScript bytecode PC; see main/hotpages.c
+#ifndef JD_HOTPAGES
+#define JD_HOTPAGES 0
+#endif
+
+// measure max interrupt latency with a hardware timer; see main/irqlat.c
+#ifndef JD_IRQ_LATENCY
+#define JD_IRQ_LATENCY 0
+#endif
+
+// bring up SD card and WiFi in background, and do I2C scan after the VM starts; see main/main.c
+#ifndef JD_DEFERRED_INIT
+#define JD_DEFERRED_INIT 1
+#endif
+
+// echo everything from wifi.benchHost, for scripts/wifibench.js; see main/wifibench.c
+#ifndef JD_WIFI_BENCH
+#define JD_WIFI_BENCH 0
+#endif
+
+// run a read benchmark on SD card at boot; see main/sdcard.c
+#ifndef JD_SD_BENCHMARK
+#define JD_SD_BENCHMARK 0
+#endif
+
 #define JD_SPI 1
 #define JD_I2C 1
 #define JD_LED_STRIP 1
@@ -63,6 +93,14 @@ const void *dcfg_base_addr(void);
 extern uint32_t flash_size, flash_base;
 #define JD_FSTOR_TOTAL_SIZE flash_size
 #define JD_FSTOR_BASE_ADDR flash_base
+// Settings pages. With several fstor slots these are shared between them (see main/flash.c), so
+// their size has to be a multiple of the 64k flash MMU page, and is set by the partition layout
+// (FSTOR_SHARED_KB in Makefile.user). Changing it moves the program image, so the first boot
+// after switching layouts starts with empty settings and no program.
+#ifdef JD_FSTOR_SHARED_KB
+#define JD_FSTOR_MAX_DATA_PAGES (JD_FSTOR_SHARED_KB / 4)
+#else
 #define JD_FSTOR_MAX_DATA_PAGES (512 / 4)
+#endif
 
 #endif
@@ -9,6 +9,7 @@
 #include "services/interfaces/jd_adc.h"
 #include "services/interfaces/jd_pwm.h"
 #include "services/interfaces/jd_flash.h"
+#include "services/interfaces/jd_spi.h"
 #include "interfaces/jd_usb.h"
 #include "network/jd_network.h"
 
@@ -37,16 +38,143 @@ void uart_log_dmesg(void);
 
 extern worker_t main_worker;
 
+// echo client for scripts/wifibench.js; only with JD_WIFI_BENCH
+void wifibench_start(void);
+
+// log time since boot of a given phase
+void boot_mark(const char *phase);
+// run part of the boot sequence off the critical path, on its own task named name
+// (inline if !JD_DEFERRED_INIT)
+void boot_run_bg(const char *name, TaskFunction_t fn, void *arg);
+// wait for SD card init to finish; it may use the same SPI host as jd_spi
+void boot_wait_sd(void);
+
 char *extract_property(const char *property_bag, int plen, const char *key);
 char *jd_hmac_b64(const char *key, const char **parts);
 
 void reboot_to_uf2(void);
 void flush_dmesg(void);
 
-void init_sdcard(void);
+// returns true if the card is mounted; jd_lstore_init() is up to the caller
+bool init_sdcard(void);
+// card is sdmmc_card_t*; replaces the default FATFS diskio for pdrv
+void sdcache_init(uint8_t pdrv, void *card);
+void sdcache_flush(void);
+// stop using the cache lock; call before anything touches FATFS in panic handler
+void sdcache_panic_begin(void);
+void sdcache_panic_flush(void);
 
 void jd_tcpsock_process(void);
 void jd_tcpsock_init(void);
 
 void get_i2c_pins(uint8_t *sda, uint8_t *scl);
-void flash_init(void);
\ No newline at end of file
+
+// Write wlen bytes from wbuf (if any), then read rlen bytes into rbuf (if any), with a repeated start.
+typedef struct {
+    uint8_t addr;
+    uint8_t wlen;
+    uint16_t rlen;
+    const uint8_t *wbuf;
+    uint8_t *rbuf;
+    int status; // set before done_fn is called
+} i2c_op_t;
+typedef void (*i2c_done_cb_t)(i2c_op_t *ops, unsigned num_ops, void *userdata);
+// Run ops on the I2C task; done_fn is called on the main task. ops and buffers have to stay
+// valid until then. Returns non-zero if not queued.
+int i2c_queue_batch(i2c_op_t *ops, unsigned num_ops, i2c_done_cb_t done_fn, void *userdata);
+
+// Set duty (as in jd_pwm_set_duty()) on several PWM outputs at once.
+void pwm_set_duty_batch(const uint8_t *pwm_ids, const uint32_t *duties, unsigned num);
+// Fade to duty over time_ms using LEDC hardware fade; immediate on MCPWM outputs.
+void pwm_fade(uint8_t pwm_id, uint32_t duty, uint32_t time_ms);
+// Apply duty updates from jd_pwm_set_duty(); called from the main loop.
+void pwm_flush(void);
+
+// Calibrated reading in millivolts, with attenuation picked automatically; -1 if not an ADC pin.
+// adc_read_pin() goes through this when adc.fullScaleMv is configured.
+int adc_read_pin_mv(uint8_t pin);
+
+// Statistics over `decimation` samples of a channel; scaled to 16 bits like adc_read_pin().
+typedef struct {
+    uint16_t min, max, mean, rms;
+} adc_stream_sample_t;
+typedef void (*adc_stream_cb_t)(const adc_stream_sample_t *samples, unsigned num_channels,
+                                void *userdata);
+// Sample pins continuously, each at sample_hz. cb (optional) gets one entry per pin, on the main
+// task. While streaming, adc_read_pin() returns the last mean for streamed pins; reading other
+// pins pauses the stream for a oneshot conversion.
+// Returns non-zero (and logs) if the configuration is rejected.
+int adc_stream_start(const uint8_t *pins, unsigned num_pins, uint32_t sample_hz,
+                     unsigned decimation, adc_stream_cb_t cb, void *userdata);
+void adc_stream_stop(void);
+// start streaming adc.streamPins, if configured
+void adc_stream_init(void);
+
+// bracket the boot-time jd_scan_all() to update the I2C presence cache
+void i2c_scan_begin(void);
+void i2c_scan_end(void);
+
+// jd_spi_init() switching between configs on the same pins doesn't re-initialize the bus
+// NULL if SPI not initialized
+const jd_spi_cfg_t *spi_current_cfg(void);
+bool spi_cfg_equal(const jd_spi_cfg_t *a, const jd_spi_cfg_t *b);
+
+// Parse ledStrip.order into order[] (each 0..2); leaves order[] as is and returns false if it's
+// missing or invalid (the latter is logged).
+bool ledstrip_config_order(uint8_t order[3]);
+bool apa102_is_enabled(void);
+int apa102_send(uint8_t pin, const uint8_t *data, unsigned size, cb_t donefn);
+void flash_init(void);
+// keep the fstor slot of the last deploy; otherwise it's rolled back after fstor.trialBoots boots
+void fstor_slot_confirm(void);
+// switch to the next fstor slot (if any) for a deploy that's about to be written
+void fstor_deploy_begin(void);
+// called by the main loop when the VM starts or stops; the slot is confirmed once it's been
+// running for fstor.confirmS
+void fstor_vm_running(bool running);
+
+// main loop phases, as recorded in the post-mortem trace
+enum {
+    LOOP_PHASE_IDLE,
+    LOOP_PHASE_JD_PROCESS,
+    LOOP_PHASE_WORKER,
+    LOOP_PHASE_TCPSOCK,
+    LOOP_PHASE_DMESG,
+    LOOP_PHASE_NUM,
+};
+const char *loop_phase_name(unsigned phase);
+
+// trace event ids; ids below 8 are LOOP_PHASE_*
+enum {
+    TRACE_ISR_JACDAC = 8,
+    TRACE_ISR_USB,
+    TRACE_JD_TIMER,
+    TRACE_TIM_WORKER,
+    TRACE_WORKER_ITEM,
+    TRACE_SOCK_OPEN,
+    TRACE_SOCK_WRITE,
+};
+
+#if JD_TRACE_EVENTS
+void trace_event(uint8_t kind, uint8_t id, uint32_t arg);
+#define TRACE_BEGIN(id, arg) trace_event('B', id, (uint32_t)(arg))
+#define TRACE_END(id) trace_event('E', id, 0)
+#else
+#define TRACE_BEGIN(id, arg) ((void)0)
+#define TRACE_END(id) ((void)0)
+#endif
+void hotpages_process(void);
+// report max interrupt latency when it grows; see main/irqlat.c
+void irqlat_process(void);
+void trace_process(void);
+
+void loopprof_phase(uint8_t phase);
+void loopprof_report(void);
+void loopprof_process(void);
+
+void rtclog_init(void);
+// print post-mortem of previous boot (if it crashed)
+void rtclog_report(void);
+void rtclog_process(void);
+void rtclog_phase(uint8_t phase);
+void rtclog_panic(void);
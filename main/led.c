@@ -9,21 +9,65 @@
 
 #define LEDC_TIMER_DIV_NUM_MAX (0x3FFFF)
 
+// LEDC timers are shared between all channels with the same divider and resolution.
+// Once LEDC channels or timers run out, MCPWM (where available) is used, one timer per output.
+// PWM ids 1..LEDC_CHANNEL_MAX are LEDC channels; higher ids are MCPWM slots.
+// Re-initializing a pin keeps its id where possible; ids that no longer refer to an
+// initialized output are ignored.
+// jd_pwm_set_duty() only records the new duty; pwm_flush(), called once per main loop
+// iteration, applies all pending ones together (as hardware fades if pwm.fadeMs is set).
+
 typedef struct timer_info {
-    uint8_t tim_num;
-    uint8_t pin;
+    uint8_t refcnt;
     uint8_t bits;
     uint32_t div;
-    uint32_t period;
 } timer_info_t;
 
+typedef struct channel_info {
+    uint8_t pin;
+    uint8_t tim_num;
+    bool fading;
+    uint32_t period;
+    uint32_t duty; // in timer ticks
+} channel_info_t;
+
 static timer_info_t timers[LEDC_TIMER_MAX];
+static channel_info_t channels[LEDC_CHANNEL_MAX];
+static bool ledc_inited;
 
 uint8_t cpu_mhz = APB_CLK_FREQ / 1000000;
 
-static void apply_config(timer_info_t *t) {
-    ledc_timer_t tim = t->tim_num;
+#if SOC_MCPWM_SUPPORTED
+#include "driver/mcpwm_prelude.h"
+
+#define MCPWM_SLOTS (SOC_MCPWM_GROUPS * SOC_MCPWM_TIMERS_PER_GROUP)
+#define MCPWM_FAST_HZ 10000000
+#define MCPWM_SLOW_HZ 1000000
+
+typedef struct {
+    uint8_t pin;
+    uint32_t period;
+    uint32_t ticks;
+    mcpwm_timer_handle_t timer;
+    mcpwm_oper_handle_t oper;
+    mcpwm_cmpr_handle_t cmpr;
+    mcpwm_gen_handle_t gen;
+} mcpwm_slot_t;
+
+static mcpwm_slot_t mcpwm_slots[MCPWM_SLOTS];
+#endif
+
+#if SOC_MCPWM_SUPPORTED
+#define PWM_MAX_ID (LEDC_CHANNEL_MAX + MCPWM_SLOTS)
+#else
+#define PWM_MAX_ID LEDC_CHANNEL_MAX
+#endif
+
+static uint32_t pending_duty[PWM_MAX_ID + 1];
+static uint32_t pending_mask;
+static int fade_ms = -1;
 
+static void apply_config(int tim, timer_info_t *t) {
     ledc_ll_set_clock_divider(&LEDC, LEDC_LOW_SPEED_MODE, tim, t->div);
 #if !defined(CONFIG_IDF_TARGET_ESP32C3) && !defined(CONFIG_IDF_TARGET_ESP32S3)
     ledc_ll_set_clock_source(&LEDC, LEDC_LOW_SPEED_MODE, tim, LEDC_APB_CLK);
@@ -36,65 +80,191 @@ static void apply_config(timer_info_t *t) {
 }
 
 static void init(void) {
-    if (timers[1].tim_num == 1)
+    if (ledc_inited)
         return;
-    for (int i = 0; i < LEDC_TIMER_MAX; ++i) {
-        timers[i].tim_num = i;
-        timers[i].pin = 0xff;
-    }
+    ledc_inited = true;
+    for (int i = 0; i < LEDC_CHANNEL_MAX; ++i)
+        channels[i].pin = NO_PIN;
+#if SOC_MCPWM_SUPPORTED
+    for (int i = 0; i < MCPWM_SLOTS; ++i)
+        mcpwm_slots[i].pin = NO_PIN;
+#endif
     periph_module_enable(PERIPH_LEDC_MODULE);
     ledc_ll_set_slow_clk_sel(&LEDC, LEDC_SLOW_CLK_APB);
 }
 
+#if SOC_MCPWM_SUPPORTED
+static void mcpwm_free_slot(mcpwm_slot_t *m) {
+    mcpwm_timer_start_stop(m->timer, MCPWM_TIMER_STOP_EMPTY);
+    mcpwm_timer_disable(m->timer);
+    mcpwm_del_generator(m->gen);
+    mcpwm_del_comparator(m->cmpr);
+    mcpwm_del_operator(m->oper);
+    mcpwm_del_timer(m->timer);
+    memset(m, 0, sizeof(*m));
+    m->pin = NO_PIN;
+}
+
+static uint8_t mcpwm_alloc(uint8_t pin, uint32_t period, uint32_t period_cycles, int prev_idx) {
+    mcpwm_slot_t *m = NULL;
+    int idx = prev_idx;
+    if (idx >= 0 && mcpwm_slots[idx].pin == NO_PIN)
+        m = &mcpwm_slots[idx];
+    for (idx = 0; !m && idx < MCPWM_SLOTS; ++idx)
+        if (mcpwm_slots[idx].pin == NO_PIN) {
+            m = &mcpwm_slots[idx];
+            break;
+        }
+    if (!m)
+        return 0;
+    idx = m - mcpwm_slots;
+
+    uint32_t res_hz = MCPWM_FAST_HZ;
+    uint32_t ticks = (uint64_t)period_cycles * res_hz / APB_CLK_FREQ;
+    if (ticks > 0xffff) {
+        res_hz = MCPWM_SLOW_HZ;
+        ticks = (uint64_t)period_cycles * res_hz / APB_CLK_FREQ;
+    }
+    if (ticks < 2 || ticks > 0xffff)
+        return 0;
+
+    mcpwm_timer_config_t timer_config = {
+        .group_id = idx / SOC_MCPWM_TIMERS_PER_GROUP,
+        .clk_src = MCPWM_TIMER_CLK_SRC_DEFAULT,
+        .resolution_hz = res_hz,
+        .count_mode = MCPWM_TIMER_COUNT_MODE_UP,
+        .period_ticks = ticks,
+    };
+    if (mcpwm_new_timer(&timer_config, &m->timer) != ESP_OK)
+        return 0;
+
+    mcpwm_operator_config_t oper_config = {.group_id = timer_config.group_id};
+    CHK(mcpwm_new_operator(&oper_config, &m->oper));
+    CHK(mcpwm_operator_connect_timer(m->oper, m->timer));
+
+    mcpwm_comparator_config_t cmpr_config = {.flags.update_cmp_on_tez = true};
+    CHK(mcpwm_new_comparator(m->oper, &cmpr_config, &m->cmpr));
+
+    mcpwm_generator_config_t gen_config = {.gen_gpio_num = pin};
+    CHK(mcpwm_new_generator(m->oper, &gen_config, &m->gen));
+
+    CHK(mcpwm_generator_set_actions_on_timer_event(
+        m->gen,
+        MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY,
+                                     MCPWM_GEN_ACTION_HIGH),
+        MCPWM_GEN_TIMER_EVENT_ACTION_END()));
+    CHK(mcpwm_generator_set_actions_on_compare_event(
+        m->gen,
+        MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, m->cmpr, MCPWM_GEN_ACTION_LOW),
+        MCPWM_GEN_COMPARE_EVENT_ACTION_END()));
+
+    CHK(mcpwm_timer_enable(m->timer));
+    CHK(mcpwm_timer_start_stop(m->timer, MCPWM_TIMER_START_NO_STOP));
+
+    m->pin = pin;
+    m->period = period;
+    m->ticks = ticks;
+
+    DMESG("PWM pin %d on MCPWM%d", pin, idx);
+
+    return LEDC_CHANNEL_MAX + 1 + idx;
+}
+#endif
+
+// returns the PWM id the pin had, or 0
+static uint8_t release_pin(uint8_t pin) {
+    uint8_t prev_id = 0;
+    for (int i = 0; i < LEDC_CHANNEL_MAX; ++i)
+        if (channels[i].pin == pin) {
+            timers[channels[i].tim_num].refcnt--;
+            channels[i].pin = NO_PIN;
+            prev_id = i + 1;
+        }
+#if SOC_MCPWM_SUPPORTED
+    for (int i = 0; i < MCPWM_SLOTS; ++i)
+        if (mcpwm_slots[i].pin == pin) {
+            mcpwm_free_slot(&mcpwm_slots[i]);
+            prev_id = LEDC_CHANNEL_MAX + 1 + i;
+        }
+#endif
+    return prev_id;
+}
+
+static void set_duty_now(uint8_t pwm_id, uint32_t duty);
+
 uint8_t jd_pwm_init(uint8_t pin, uint32_t period, uint32_t duty, uint8_t prescaler) {
     init();
 
     uint32_t period_cycles = period * prescaler;
-    timer_info_t *t = NULL;
+    uint32_t div = 0;
+    int bits;
 
-    for (int bits = LEDC_TIMER_BIT_MAX - 1; bits >= 4; bits--) {
-        uint32_t div = (period_cycles << 8) >> bits;
-        if (div < 256)
-            continue;
-        if (div > LEDC_TIMER_DIV_NUM_MAX) {
-            DMESG("! PWM too fast");
-            hw_panic();
-        }
+    for (bits = LEDC_TIMER_BIT_MAX - 1; bits >= 4; bits--) {
+        div = (period_cycles << 8) >> bits;
+        if (div >= 256)
+            break;
+    }
+    if (div > LEDC_TIMER_DIV_NUM_MAX || div < 256) {
+        DMESG("! PWM period out of range");
+        return 0;
+    }
 
-        for (unsigned i = 0; i < LEDC_TIMER_MAX; ++i) {
-            t = &timers[i];
-            if (t->pin == pin)
-                break;
-            t = NULL;
+    // re-initializing a pin frees its previous channel, which is then preferred
+    uint8_t prev_id = release_pin(pin);
+    pending_mask &= ~(1 << prev_id);
+
+    int ch = -1;
+    if (prev_id && prev_id <= LEDC_CHANNEL_MAX)
+        ch = prev_id - 1;
+    for (int i = 0; ch < 0 && i < LEDC_CHANNEL_MAX; ++i)
+        if (channels[i].pin == NO_PIN) {
+            ch = i;
+            break;
         }
 
-        if (t == NULL)
-            for (unsigned i = 0; i < LEDC_TIMER_MAX; ++i) {
-                t = &timers[i];
-                if (t->pin == 0xff)
-                    break;
-                t = NULL;
+    int tim = -1;
+    if (ch >= 0) {
+        // share a timer with identical config, or take a free one
+        for (int i = 0; i < LEDC_TIMER_MAX; ++i)
+            if (timers[i].refcnt && timers[i].div == div && timers[i].bits == bits) {
+                tim = i;
+                break;
             }
+        if (tim < 0)
+            for (int i = 0; i < LEDC_TIMER_MAX; ++i)
+                if (!timers[i].refcnt) {
+                    tim = i;
+                    timers[i].div = div;
+                    timers[i].bits = bits;
+                    apply_config(i, &timers[i]);
+                    break;
+                }
+    }
 
-        if (t == NULL) {
-            DMESG("! out of LEDC timers");
-            hw_panic();
+    if (tim < 0) {
+        uint8_t pwm_id = 0;
+#if SOC_MCPWM_SUPPORTED
+        pwm_id = mcpwm_alloc(pin, period, period_cycles,
+                             prev_id > LEDC_CHANNEL_MAX ? prev_id - LEDC_CHANNEL_MAX - 1 : -1);
+#endif
+        if (pwm_id == 0) {
+            DMESG("! out of PWM channels");
+            return 0;
         }
-
-        t->pin = pin;
-        t->div = div;
-        t->bits = bits;
-        t->period = period;
-        apply_config(t);
-
-        break;
+        set_duty_now(pwm_id, duty);
+        return pwm_id;
     }
 
-    int ch = t->tim_num; // we bind timers to channels 1-1
-    int tim = t->tim_num;
-    int pwm_id = t->tim_num + 1;
+    timers[tim].refcnt++;
+    channels[ch].pin = pin;
+    channels[ch].tim_num = tim;
+    channels[ch].period = period;
+    // make sure fade registers get reset
+    channels[ch].fading = true;
+
+    int pwm_id = ch + 1;
 
-    jd_pwm_set_duty(pwm_id, duty);
+    set_duty_now(pwm_id, duty);
 
     ledc_ll_bind_channel_timer(&LEDC, LEDC_LOW_SPEED_MODE, ch, tim);
     ledc_ll_ls_channel_update(&LEDC, LEDC_LOW_SPEED_MODE, ch);
@@ -104,42 +274,192 @@ uint8_t jd_pwm_init(uint8_t pin, uint32_t period, uint32_t duty, uint8_t prescal
     return pwm_id;
 }
 
-void jd_pwm_set_duty(uint8_t pwm_id, uint32_t duty) {
-    JD_ASSERT(pwm_id > 0);
-    JD_ASSERT(pwm_id <= LEDC_TIMER_MAX);
+#if SOC_MCPWM_SUPPORTED
+// NULL if pwm_id isn't an initialized MCPWM output
+static mcpwm_slot_t *mcpwm_slot(uint8_t pwm_id) {
+    if (pwm_id <= LEDC_CHANNEL_MAX || pwm_id - LEDC_CHANNEL_MAX > MCPWM_SLOTS)
+        return NULL;
+    mcpwm_slot_t *m = &mcpwm_slots[pwm_id - LEDC_CHANNEL_MAX - 1];
+    return m->pin == NO_PIN ? NULL : m;
+}
 
-    timer_info_t *t = &timers[pwm_id - 1];
-    int ch = t->tim_num;
+static bool mcpwm_set_duty(uint8_t pwm_id, uint32_t duty) {
+    if (pwm_id <= LEDC_CHANNEL_MAX)
+        return false;
+    mcpwm_slot_t *m = mcpwm_slot(pwm_id);
+    if (!m)
+        return true; // stale id
+    uint32_t cmp = (uint64_t)m->ticks * duty / m->period;
+    if (cmp > m->ticks)
+        cmp = m->ticks;
+    CHK(mcpwm_comparator_set_compare_value(m->cmpr, cmp));
+    return true;
+}
+#else
+#define mcpwm_set_duty(id, d) false
+#endif
 
-    uint32_t max = 1 << t->bits;
-    duty = max * duty / t->period;
+// -1 if pwm_id isn't an initialized LEDC output
+static int ledc_ch(uint8_t pwm_id) {
+    if (pwm_id == 0 || pwm_id > LEDC_CHANNEL_MAX || channels[pwm_id - 1].pin == NO_PIN)
+        return -1;
+    return pwm_id - 1;
+}
+
+static uint32_t ledc_scale_duty(channel_info_t *c, uint32_t duty) {
+    uint32_t max = 1 << timers[c->tim_num].bits;
+    duty = (uint64_t)max * duty / c->period;
     if (duty >= max)
         duty = max - 1;
+    return duty;
+}
 
+// sets the duty registers; takes effect after ledc_commit()
+static void ledc_write_duty(int ch, uint32_t duty) {
+    channel_info_t *c = &channels[ch];
     ledc_ll_set_duty_int_part(&LEDC, LEDC_LOW_SPEED_MODE, ch, duty);
-    ledc_ll_set_duty_direction(&LEDC, LEDC_LOW_SPEED_MODE, ch, 1);
-    ledc_ll_set_duty_num(&LEDC, LEDC_LOW_SPEED_MODE, ch, 0);
-    ledc_ll_set_duty_cycle(&LEDC, LEDC_LOW_SPEED_MODE, ch, 0);
-    ledc_ll_set_duty_scale(&LEDC, LEDC_LOW_SPEED_MODE, ch, 0);
-    ledc_ll_ls_channel_update(&LEDC, LEDC_LOW_SPEED_MODE, ch);
+    // fade parameters only need resetting after a fade
+    if (c->fading) {
+        c->fading = false;
+        ledc_ll_set_duty_direction(&LEDC, LEDC_LOW_SPEED_MODE, ch, 1);
+        ledc_ll_set_duty_num(&LEDC, LEDC_LOW_SPEED_MODE, ch, 0);
+        ledc_ll_set_duty_cycle(&LEDC, LEDC_LOW_SPEED_MODE, ch, 0);
+        ledc_ll_set_duty_scale(&LEDC, LEDC_LOW_SPEED_MODE, ch, 0);
+    }
+    c->duty = duty;
+}
 
+static void ledc_commit(int ch) {
     ledc_ll_set_sig_out_en(&LEDC, LEDC_LOW_SPEED_MODE, ch, true);
     ledc_ll_set_duty_start(&LEDC, LEDC_LOW_SPEED_MODE, ch, true);
     ledc_ll_ls_channel_update(&LEDC, LEDC_LOW_SPEED_MODE, ch);
 }
 
+static void set_duty_now(uint8_t pwm_id, uint32_t duty) {
+    pwm_set_duty_batch(&pwm_id, &duty, 1);
+}
+
+void pwm_set_duty_batch(const uint8_t *pwm_ids, const uint32_t *duties, unsigned num) {
+    // write all the registers first, so that the new values start at (nearly) the same time
+    for (unsigned i = 0; i < num; ++i) {
+        if (mcpwm_set_duty(pwm_ids[i], duties[i]))
+            continue;
+        int ch = ledc_ch(pwm_ids[i]);
+        if (ch >= 0)
+            ledc_write_duty(ch, ledc_scale_duty(&channels[ch], duties[i]));
+    }
+    for (unsigned i = 0; i < num; ++i) {
+        int ch = ledc_ch(pwm_ids[i]);
+        if (ch >= 0)
+            ledc_commit(ch);
+    }
+}
+
+#define LEDC_FADE_MAX 1023 // duty_num, duty_cycle and duty_scale are 10 bit
+
+void pwm_fade(uint8_t pwm_id, uint32_t duty, uint32_t time_ms) {
+    if (mcpwm_set_duty(pwm_id, duty))
+        return; // no hardware fade on MCPWM
+
+    int ch = ledc_ch(pwm_id);
+    if (ch < 0)
+        return;
+    channel_info_t *c = &channels[ch];
+    timer_info_t *t = &timers[c->tim_num];
+    uint32_t target = ledc_scale_duty(c, duty);
+    uint32_t delta = target > c->duty ? target - c->duty : c->duty - target;
+
+    // PWM cycles in the fade time; one PWM cycle is div/256 * 2^bits APB cycles
+    uint64_t pwm_cycle_apb = ((uint64_t)t->div << t->bits) >> 8;
+    uint32_t total_cycles = (uint64_t)time_ms * (APB_CLK_FREQ / 1000) / pwm_cycle_apb;
+
+    if (delta == 0 || total_cycles == 0) {
+        set_duty_now(pwm_id, duty);
+        return;
+    }
+
+    uint32_t scale = (delta + LEDC_FADE_MAX - 1) / LEDC_FADE_MAX;
+    if (scale > LEDC_FADE_MAX)
+        scale = LEDC_FADE_MAX;
+    uint32_t steps = delta / scale;
+    if (steps > LEDC_FADE_MAX)
+        steps = LEDC_FADE_MAX;
+    uint32_t cycles = total_cycles / steps;
+    if (cycles < 1)
+        cycles = 1;
+    if (cycles > LEDC_FADE_MAX)
+        cycles = LEDC_FADE_MAX;
+
+    bool up = target > c->duty;
+    ledc_ll_set_duty_int_part(&LEDC, LEDC_LOW_SPEED_MODE, ch, c->duty);
+    ledc_ll_set_duty_direction(&LEDC, LEDC_LOW_SPEED_MODE, ch, up);
+    ledc_ll_set_duty_num(&LEDC, LEDC_LOW_SPEED_MODE, ch, steps);
+    ledc_ll_set_duty_cycle(&LEDC, LEDC_LOW_SPEED_MODE, ch, cycles);
+    ledc_ll_set_duty_scale(&LEDC, LEDC_LOW_SPEED_MODE, ch, scale);
+    ledc_commit(ch);
+
+    // the fade may stop short of target by less than one step
+    c->duty = up ? c->duty + steps * scale : c->duty - steps * scale;
+    c->fading = true;
+}
+
+void jd_pwm_set_duty(uint8_t pwm_id, uint32_t duty) {
+    // 0 (what jd_pwm_init() returns on failure) and stale ids are ignored when applied
+    if (pwm_id == 0 || pwm_id > PWM_MAX_ID)
+        return;
+    pending_duty[pwm_id] = duty;
+    pending_mask |= 1 << pwm_id;
+}
+
+void pwm_flush(void) {
+    if (!pending_mask)
+        return;
+
+    if (fade_ms < 0)
+        fade_ms = dcfg_get_i32("pwm.fadeMs", 0);
+
+    uint8_t ids[PWM_MAX_ID];
+    uint32_t duties[PWM_MAX_ID];
+    unsigned num = 0;
+    for (int id = 1; id <= PWM_MAX_ID; ++id)
+        if (pending_mask & (1 << id)) {
+            if (fade_ms > 0) {
+                pwm_fade(id, pending_duty[id], fade_ms);
+            } else {
+                ids[num] = id;
+                duties[num] = pending_duty[id];
+                num++;
+            }
+        }
+    pending_mask = 0;
+
+    pwm_set_duty_batch(ids, duties, num);
+}
+
 void jd_pwm_enable(uint8_t pwm_id, bool enabled) {
-    JD_ASSERT(pwm_id > 0);
-    JD_ASSERT(pwm_id <= LEDC_TIMER_MAX);
+    // keep the order of duty updates and enabling
+    pwm_flush();
+
+#if SOC_MCPWM_SUPPORTED
+    if (pwm_id > LEDC_CHANNEL_MAX) {
+        mcpwm_slot_t *m = mcpwm_slot(pwm_id);
+        // -1 removes the force
+        if (m)
+            CHK(mcpwm_generator_set_force_level(m->gen, enabled ? -1 : 0, true));
+        return;
+    }
+#endif
 
-    timer_info_t *t = &timers[pwm_id - 1];
-    int ch = t->tim_num;
+    int ch = ledc_ch(pwm_id);
+    if (ch < 0)
+        return;
+    channel_info_t *c = &channels[ch];
 
-    pin_setup_output(t->pin);
+    pin_setup_output(c->pin);
     if (enabled) {
         bool output_invert = false;
         esp_rom_gpio_connect_out_signal(
-            t->pin, ledc_periph_signal[LEDC_LOW_SPEED_MODE].sig_out0_idx + ch, output_invert, 0);
+            c->pin, ledc_periph_signal[LEDC_LOW_SPEED_MODE].sig_out0_idx + ch, output_invert, 0);
     }
 }
 
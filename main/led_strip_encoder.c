@@ -4,37 +4,133 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <math.h>
+#include <string.h>
 #include "esp_check.h"
+#include "esp_heap_caps.h"
 #include "led_strip_encoder.h"
 
 static const char *TAG = "led_encoder";
 
+#define LED_SYMBOLS_PER_BYTE 8
+
 typedef struct {
     rmt_encoder_t base;
-    rmt_encoder_t *bytes_encoder;
     rmt_encoder_t *copy_encoder;
     int state;
+    size_t pos; // output byte position
+    size_t pix_pos; // input offset of the current pixel, when transforming pixels
+    uint8_t pix_byte; // output byte within the current pixel
+    bool transform_pixels;
+    bool rgbw;
+    uint8_t order[3];
+    uint8_t xform[256]; // brightness and gamma
     rmt_symbol_word_t reset_code;
 } rmt_led_strip_encoder_t;
 
+// RMT symbols for every byte value, MSB first; in internal RAM, since it's read from the RMT ISR
+// (8KB, allocated when the first encoder is created; one table entry per byte keeps the ISR short)
+static rmt_symbol_word_t (*led_symbols)[LED_SYMBOLS_PER_BYTE];
+static uint32_t led_symbols_resolution;
+
+static esp_err_t led_symbols_init(uint32_t resolution)
+{
+    if (led_symbols) {
+        return led_symbols_resolution == resolution ? ESP_OK : ESP_ERR_INVALID_ARG;
+    }
+    led_symbols = heap_caps_malloc(256 * sizeof(led_symbols[0]), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!led_symbols) {
+        return ESP_ERR_NO_MEM;
+    }
+    led_symbols_resolution = resolution;
+    // different led strip might have its own timing requirements, following parameter is for WS2812
+    const rmt_symbol_word_t bit0 = {
+        .level0 = 1,
+        .duration0 = 0.3 * resolution / 1000000, // T0H=0.3us
+        .level1 = 0,
+        .duration1 = 0.9 * resolution / 1000000, // T0L=0.9us
+    };
+    const rmt_symbol_word_t bit1 = {
+        .level0 = 1,
+        .duration0 = 0.9 * resolution / 1000000, // T1H=0.9us
+        .level1 = 0,
+        .duration1 = 0.3 * resolution / 1000000, // T1L=0.3us
+    };
+    for (int v = 0; v < 256; v++) {
+        // WS2812 transfer bit order: G7...G0R7...R0B7...B0
+        for (int b = 0; b < LED_SYMBOLS_PER_BYTE; b++) {
+            led_symbols[v][b] = (v & (0x80 >> b)) ? bit1 : bit0;
+        }
+    }
+    return ESP_OK;
+}
+
+static size_t led_output_size(rmt_led_strip_encoder_t *led_encoder, size_t data_size)
+{
+    return led_encoder->rgbw ? data_size / 3 * 4 : data_size;
+}
+
+// the pixel position is tracked incrementally, so there's no division in the RMT ISR
+static uint8_t led_output_byte(rmt_led_strip_encoder_t *led_encoder, const uint8_t *data, size_t data_size)
+{
+    uint8_t v;
+    if (!led_encoder->transform_pixels) {
+        v = data[led_encoder->pos];
+    } else {
+        int j = led_encoder->pix_byte;
+        if (led_encoder->pix_pos + 3 > data_size) {
+            v = data[led_encoder->pix_pos + j]; // trailing partial pixel
+        } else {
+            const uint8_t *px = data + led_encoder->pix_pos;
+            uint8_t w = 0;
+            if (led_encoder->rgbw) {
+                w = px[0] < px[1] ? px[0] : px[1];
+                if (px[2] < w) {
+                    w = px[2];
+                }
+            }
+            v = j == 3 ? w : px[led_encoder->order[j]] - w;
+        }
+    }
+    return led_encoder->xform[v];
+}
+
+static void led_next_byte(rmt_led_strip_encoder_t *led_encoder)
+{
+    led_encoder->pos++;
+    if (++led_encoder->pix_byte == (led_encoder->rgbw ? 4 : 3)) {
+        led_encoder->pix_byte = 0;
+        led_encoder->pix_pos += 3;
+    }
+}
+
 static size_t rmt_encode_led_strip(rmt_encoder_t *encoder, rmt_channel_handle_t channel, const void *primary_data, size_t data_size, rmt_encode_state_t *ret_state)
 {
     rmt_led_strip_encoder_t *led_encoder = __containerof(encoder, rmt_led_strip_encoder_t, base);
-    rmt_encoder_handle_t bytes_encoder = led_encoder->bytes_encoder;
     rmt_encoder_handle_t copy_encoder = led_encoder->copy_encoder;
     rmt_encode_state_t session_state = 0;
     rmt_encode_state_t state = 0;
     size_t encoded_symbols = 0;
+    size_t out_size = led_output_size(led_encoder, data_size);
     switch (led_encoder->state) {
-    case 0: // send RGB data
-        encoded_symbols += bytes_encoder->encode(bytes_encoder, channel, primary_data, data_size, &session_state);
-        if (session_state & RMT_ENCODING_COMPLETE) {
-            led_encoder->state = 1; // switch to next state when current encoding session finished
-        }
-        if (session_state & RMT_ENCODING_MEM_FULL) {
-            state |= RMT_ENCODING_MEM_FULL;
-            goto out; // yield if there's no free space for encoding artifacts
+    case 0: // send RGB data, one byte (table entry) at a time
+        while (led_encoder->pos < out_size) {
+            uint8_t v = led_output_byte(led_encoder, primary_data, data_size);
+            // the copy encoder keeps its offset within the entry, if it doesn't fit in full
+            encoded_symbols += copy_encoder->encode(copy_encoder, channel, led_symbols[v],
+                                                    sizeof(led_symbols[v]), &session_state);
+            if (session_state & RMT_ENCODING_COMPLETE) {
+                led_next_byte(led_encoder);
+            }
+            if (session_state & RMT_ENCODING_MEM_FULL) {
+                state |= RMT_ENCODING_MEM_FULL;
+                goto out; // yield if there's no free space for encoding artifacts
+            }
         }
+        led_encoder->state = 1; // switch to next state when current encoding session finished
+        led_encoder->pos = 0;
+        led_encoder->pix_pos = 0;
+        led_encoder->pix_byte = 0;
     // fall-through
     case 1: // send reset code
         encoded_symbols += copy_encoder->encode(copy_encoder, channel, &led_encoder->reset_code,
@@ -56,7 +152,6 @@ out:
 static esp_err_t rmt_del_led_strip_encoder(rmt_encoder_t *encoder)
 {
     rmt_led_strip_encoder_t *led_encoder = __containerof(encoder, rmt_led_strip_encoder_t, base);
-    rmt_del_encoder(led_encoder->bytes_encoder);
     rmt_del_encoder(led_encoder->copy_encoder);
     free(led_encoder);
     return ESP_OK;
@@ -65,9 +160,11 @@ static esp_err_t rmt_del_led_strip_encoder(rmt_encoder_t *encoder)
 static esp_err_t rmt_led_strip_encoder_reset(rmt_encoder_t *encoder)
 {
     rmt_led_strip_encoder_t *led_encoder = __containerof(encoder, rmt_led_strip_encoder_t, base);
-    rmt_encoder_reset(led_encoder->bytes_encoder);
     rmt_encoder_reset(led_encoder->copy_encoder);
     led_encoder->state = 0;
+    led_encoder->pos = 0;
+    led_encoder->pix_pos = 0;
+    led_encoder->pix_byte = 0;
     return ESP_OK;
 }
 
@@ -81,23 +178,33 @@ esp_err_t rmt_new_led_strip_encoder(const led_strip_encoder_config_t *config, rm
     led_encoder->base.encode = rmt_encode_led_strip;
     led_encoder->base.del = rmt_del_led_strip_encoder;
     led_encoder->base.reset = rmt_led_strip_encoder_reset;
-    // different led strip might have its own timing requirements, following parameter is for WS2812
-    rmt_bytes_encoder_config_t bytes_encoder_config = {
-        .bit0 = {
-            .level0 = 1,
-            .duration0 = 0.3 * config->resolution / 1000000, // T0H=0.3us
-            .level1 = 0,
-            .duration1 = 0.9 * config->resolution / 1000000, // T0L=0.9us
-        },
-        .bit1 = {
-            .level0 = 1,
-            .duration0 = 0.9 * config->resolution / 1000000, // T1H=0.9us
-            .level1 = 0,
-            .duration1 = 0.3 * config->resolution / 1000000, // T1L=0.3us
-        },
-        .flags.msb_first = 1 // WS2812 transfer bit order: G7...G0R7...R0B7...B0
-    };
-    ESP_GOTO_ON_ERROR(rmt_new_bytes_encoder(&bytes_encoder_config, &led_encoder->bytes_encoder), err, TAG, "create bytes encoder failed");
+    ESP_GOTO_ON_ERROR(led_symbols_init(config->resolution), err, TAG, "create symbol table failed");
+    for (int v = 0; v < 256; v++) {
+        float f = v / 255.0f;
+        if (config->gamma10) {
+            f = powf(f, config->gamma10 / 10.0f);
+        }
+        if (config->brightness) {
+            f = f * (config->brightness + 1) / 256;
+        }
+        led_encoder->xform[v] = (uint8_t)(f * 255 + 0.5f);
+    }
+    static const uint8_t no_order[3];
+    if (memcmp(config->order, no_order, sizeof(no_order)) == 0) {
+        for (int j = 0; j < 3; j++) {
+            led_encoder->order[j] = j;
+        }
+    } else {
+        for (int j = 0; j < 3; j++) {
+            ESP_GOTO_ON_FALSE(config->order[j] < 3, ESP_ERR_INVALID_ARG, err, TAG, "invalid color order");
+            led_encoder->order[j] = config->order[j];
+        }
+        led_encoder->transform_pixels = true;
+    }
+    led_encoder->rgbw = config->rgbw;
+    if (config->rgbw) {
+        led_encoder->transform_pixels = true;
+    }
     rmt_copy_encoder_config_t copy_encoder_config = {};
     ESP_GOTO_ON_ERROR(rmt_new_copy_encoder(&copy_encoder_config, &led_encoder->copy_encoder), err, TAG, "create copy encoder failed");
 
@@ -112,9 +219,6 @@ esp_err_t rmt_new_led_strip_encoder(const led_strip_encoder_config_t *config, rm
     return ESP_OK;
 err:
     if (led_encoder) {
-        if (led_encoder->bytes_encoder) {
-            rmt_del_encoder(led_encoder->bytes_encoder);
-        }
         if (led_encoder->copy_encoder) {
             rmt_del_encoder(led_encoder->copy_encoder);
         }
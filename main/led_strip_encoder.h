@@ -6,6 +6,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "driver/rmt_encoder.h"
 
 #ifdef __cplusplus
@@ -17,11 +18,18 @@ extern "C" {
  */
 typedef struct {
     uint32_t resolution; /*!< Encoder resolution, in Hz */
+    uint8_t brightness;  /*!< Scale every byte by (brightness + 1) / 256; 0 disables scaling */
+    uint8_t gamma10;     /*!< Gamma correction exponent times 10 (eg. 22 for 2.2); 0 disables it */
+    uint8_t order[3];    /*!< Output byte j of a pixel is input byte order[j]; all zero keeps order */
+    bool rgbw;           /*!< Append white byte min(r,g,b) to each 3-byte pixel, and subtract it */
 } led_strip_encoder_config_t;
 
 /**
  * @brief Create RMT encoder for encoding LED strip pixels into RMT symbols
  *
+ * @note Bytes are expanded through a precomputed 256-entry symbol table (shared by all
+ *       encoders), with the brightness/gamma/order transforms applied on the fly.
+ *
  * @param[in] config Encoder configuration
  * @param[out] ret_encoder Returned encoder handle
  * @return
@@ -2,12 +2,19 @@
 #include "devs_internal.h"
 #include "led_strip_encoder.h"
 #include "driver/rmt_tx.h"
+#include "esp_timer.h"
 
 #define RMT_LED_STRIP_RESOLUTION_HZ                                                                \
     10000000 // 10MHz resolution, 1 tick = 0.1us (led strip needs a high resolution)
 
-static void setup_strip(uint8_t pin, int mem_block_symbols, rmt_channel_handle_t *led_chan,
-                        rmt_encoder_handle_t *led_encoder) {
+#if SOC_RMT_SUPPORT_DMA
+// DMA buffer size; it's refilled in large chunks, rather than per RMT memory block in the ISR
+#define LED_DMA_SYMBOLS 1024
+#endif
+
+static esp_err_t setup_strip(uint8_t pin, int mem_block_symbols, bool with_dma,
+                             const led_strip_encoder_config_t *encoder_config,
+                             rmt_channel_handle_t *led_chan, rmt_encoder_handle_t *led_encoder) {
     rmt_tx_channel_config_t tx_chan_config = {
         .clk_src = RMT_CLK_SRC_DEFAULT, // select source clock
         .gpio_num = pin,
@@ -15,17 +22,17 @@ static void setup_strip(uint8_t pin, int mem_block_symbols, rmt_channel_handle_t
         .resolution_hz = RMT_LED_STRIP_RESOLUTION_HZ,
         .trans_queue_depth =
             4, // set the number of transactions that can be pending in the background
+        .flags.with_dma = with_dma,
     };
-    ESP_ERROR_CHECK(rmt_new_tx_channel(&tx_chan_config, led_chan));
+    esp_err_t r = rmt_new_tx_channel(&tx_chan_config, led_chan);
+    if (r != ESP_OK)
+        return r;
 
-    if (!*led_encoder) {
-        led_strip_encoder_config_t encoder_config = {
-            .resolution = RMT_LED_STRIP_RESOLUTION_HZ,
-        };
-        ESP_ERROR_CHECK(rmt_new_led_strip_encoder(&encoder_config, led_encoder));
-    }
+    if (!*led_encoder)
+        ESP_ERROR_CHECK(rmt_new_led_strip_encoder(encoder_config, led_encoder));
 
     ESP_ERROR_CHECK(rmt_enable(*led_chan));
+    return ESP_OK;
 }
 
 static void transmit(rmt_channel_handle_t led_chan, rmt_encoder_handle_t led_encoder,
@@ -46,7 +53,11 @@ void jd_rgbext_init(int type, uint8_t pin) {
     if (rgbext_chan)
         return;
     if (type == 1) {
-        setup_strip(pin, SOC_RMT_MEM_WORDS_PER_CHANNEL, &rgbext_chan, &rgbext_encoder);
+        led_strip_encoder_config_t encoder_config = {
+            .resolution = RMT_LED_STRIP_RESOLUTION_HZ,
+        };
+        CHK(setup_strip(pin, SOC_RMT_MEM_WORDS_PER_CHANNEL, false, &encoder_config, &rgbext_chan,
+                        &rgbext_encoder));
     }
 }
 
@@ -59,47 +70,238 @@ void jd_rgbext_set(uint8_t r, uint8_t g, uint8_t b) {
     }
 }
 
-static rmt_channel_handle_t led_chan;
-static rmt_encoder_handle_t led_encoder;
-static uint8_t led_pin, led_in_use;
-static cb_t led_done_fn;
-static uint32_t last_ctx_no;
+// Frames are copied into one of two buffers, so the next frame can be prepared (and queued)
+// while the current one is being sent out.
+#define LED_NUM_FRAMES 2
+// Each pin gets its own RMT channel (and encoder, which is stateful), kept around between
+// frames, so that several strips are driven concurrently without channel re-setup.
+// All strip state (pending frames, channel enable/disable, waiting callback) is only touched
+// from the main task; RMT completions are forwarded there.
+#define LED_MAX_STRIPS SOC_RMT_TX_CANDIDATES_PER_GROUP
+// achieved frame rate is logged this often, for strips that were used
+#define LED_STATS_US (10 * 1000000)
+// WS2812 bit time
+#define LED_NS_PER_BIT 1250
+
+typedef struct {
+    rmt_channel_handle_t chan;
+    rmt_encoder_handle_t encoder;
+    uint8_t pin;
+    uint8_t pending, next_frame;
+    uint8_t *frames[LED_NUM_FRAMES];
+    unsigned frame_alloc[LED_NUM_FRAMES];
+    cb_t waiting_fn;
+    uint32_t last_used;
+    uint32_t frame_size;
+    uint32_t stats_frames, stats_max_gap;
+    int64_t stats_start, last_done;
+} led_strip_t;
+
+static led_strip_t strips[LED_MAX_STRIPS];
+static uint32_t last_ctx_no, use_counter;
+
+static void call_fn(void *f) {
+    cb_t ff = f;
+    if (ff)
+        ff();
+}
+
+static void frame_stats(led_strip_t *strip) {
+    int64_t now_us = esp_timer_get_time();
+    // start a new window at first frame, or after the strip was idle
+    if (!strip->stats_start || now_us - strip->last_done >= LED_STATS_US) {
+        strip->stats_start = now_us;
+        strip->stats_frames = 0;
+        strip->stats_max_gap = 0;
+    } else {
+        uint32_t gap = now_us - strip->last_done;
+        if (gap > strip->stats_max_gap)
+            strip->stats_max_gap = gap;
+        strip->stats_frames++;
+    }
+    strip->last_done = now_us;
+
+    int64_t elapsed = now_us - strip->stats_start;
+    if (elapsed >= LED_STATS_US) {
+        DMESG("ledstrip: pin %d: %u fps, %u B/frame (%uus on wire), max gap %uus", strip->pin,
+              (unsigned)(strip->stats_frames * 1000000LL / elapsed), (unsigned)strip->frame_size,
+              (unsigned)(strip->frame_size * 8 * LED_NS_PER_BIT / 1000),
+              (unsigned)strip->stats_max_gap);
+        strip->stats_start = now_us;
+        strip->stats_frames = 0;
+        strip->stats_max_gap = 0;
+    }
+}
+
+static void led_strip_done_main(void *userdata) {
+    led_strip_t *strip = userdata;
+    JD_ASSERT(strip->pending > 0);
+    frame_stats(strip);
+    if (--strip->pending == 0)
+        rmt_disable(strip->chan);
+    cb_t f = strip->waiting_fn;
+    if (f) {
+        strip->waiting_fn = NULL;
+        f();
+    }
+}
 
 static void led_strip_done_outside_isr(void *userdata) {
-    rmt_disable(led_chan);
-    led_in_use = false;
-    led_done_fn();
+    worker_run(main_worker, led_strip_done_main, userdata);
+    jdesp_wake_main();
 }
 
 static bool led_strip_done(rmt_channel_handle_t tx_chan, const rmt_tx_done_event_data_t *edata,
                            void *user_ctx) {
-    JD_ASSERT(led_in_use);
-    tim_worker_run(led_strip_done_outside_isr, NULL);
+    tim_worker_run(led_strip_done_outside_isr, user_ctx);
     return false;
 }
 
+static void led_free_strip(led_strip_t *strip) {
+    JD_ASSERT(!strip->pending);
+    if (strip->chan) {
+        // channel is disabled when there is nothing pending
+        CHK(rmt_del_channel(strip->chan));
+        CHK(rmt_del_encoder(strip->encoder));
+    }
+    for (int i = 0; i < LED_NUM_FRAMES; ++i)
+        jd_free(strip->frames[i]);
+    memset(strip, 0, sizeof(*strip));
+}
+
+bool ledstrip_config_order(uint8_t order[3]) {
+    const char *ord = dcfg_get_string("ledStrip.order", NULL);
+    if (!ord)
+        return false;
+    bool valid = strlen(ord) == 3;
+    for (int j = 0; valid && j < 3; ++j)
+        valid = ord[j] >= '0' && ord[j] <= '2';
+    if (!valid) {
+        // keep the default order rather than failing setup
+        DMESG("ledstrip: invalid ledStrip.order '%s'", ord);
+        return false;
+    }
+    for (int j = 0; j < 3; ++j)
+        order[j] = ord[j] - '0';
+    return true;
+}
+
+// brightness, gamma and color order transforms are applied by the encoder, as bytes are sent out
+static void led_encoder_config(led_strip_encoder_config_t *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->resolution = RMT_LED_STRIP_RESOLUTION_HZ;
+    cfg->brightness = dcfg_get_i32("ledStrip.brightness", 0);
+    cfg->gamma10 = dcfg_get_i32("ledStrip.gamma10", 0);
+    cfg->rgbw = dcfg_get_i32("ledStrip.rgbw", 0) != 0;
+    ledstrip_config_order(cfg->order);
+}
+
+static esp_err_t led_new_channel(led_strip_t *strip) {
+    esp_err_t r = ESP_FAIL;
+    led_strip_encoder_config_t encoder_config;
+    led_encoder_config(&encoder_config);
+#if SOC_RMT_SUPPORT_DMA
+    // there are few DMA-capable channels; fall back to plain RMT memory if taken
+    r = setup_strip(strip->pin, LED_DMA_SYMBOLS, true, &encoder_config, &strip->chan,
+                    &strip->encoder);
+#endif
+    if (r != ESP_OK)
+        r = setup_strip(strip->pin, SOC_RMT_MEM_WORDS_PER_CHANNEL, false, &encoder_config,
+                        &strip->chan, &strip->encoder);
+    if (r != ESP_OK)
+        return r;
+    rmt_tx_event_callbacks_t cbs = {.on_trans_done = led_strip_done};
+    CHK(rmt_tx_register_event_callbacks(strip->chan, &cbs, strip));
+    return ESP_OK;
+}
+
+static led_strip_t *led_get_strip(uint8_t pin) {
+    led_strip_t *free_strip = NULL, *lru = NULL;
+
+    for (int i = 0; i < LED_MAX_STRIPS; ++i) {
+        led_strip_t *strip = &strips[i];
+        if (strip->chan && strip->pin == pin)
+            return strip;
+        if (!strip->chan) {
+            if (!free_strip)
+                free_strip = strip;
+        } else if (!strip->pending && (!lru || strip->last_used < lru->last_used)) {
+            lru = strip;
+        }
+    }
+
+    if (!free_strip) {
+        if (!lru)
+            return NULL;
+        led_free_strip(lru);
+        free_strip = lru;
+    }
+
+    free_strip->pin = pin;
+    while (led_new_channel(free_strip) != ESP_OK) {
+        // out of RMT channels (eg. taken by the status LED); evict the least recently used strip
+        lru = NULL;
+        for (int i = 0; i < LED_MAX_STRIPS; ++i) {
+            led_strip_t *strip = &strips[i];
+            if (strip != free_strip && strip->chan && !strip->pending &&
+                (!lru || strip->last_used < lru->last_used))
+                lru = strip;
+        }
+        if (!lru) {
+            free_strip->pin = 0;
+            return NULL;
+        }
+        led_free_strip(lru);
+    }
+
+    return free_strip;
+}
+
 int devs_led_strip_send(devs_ctx_t *ctx, uint8_t pin, const uint8_t *data, unsigned size,
                         cb_t donefn) {
-    if (led_in_use)
-        return -100;
+    if (apa102_is_enabled())
+        return apa102_send(pin, data, size, donefn);
 
-    if (!led_chan || led_pin != pin || last_ctx_no != ctx->ctx_seq_no) {
-        led_pin = pin;
+    if (last_ctx_no != ctx->ctx_seq_no) {
+        // new program; drop all channels, once they are done with the old frames
+        for (int i = 0; i < LED_MAX_STRIPS; ++i)
+            if (strips[i].pending)
+                return -100;
+        for (int i = 0; i < LED_MAX_STRIPS; ++i)
+            led_free_strip(&strips[i]);
         last_ctx_no = ctx->ctx_seq_no;
-        if (led_chan) {
-            // free-up any previously allocated channel
-            CHK(rmt_del_channel(led_chan));
-        }
-        setup_strip(pin, SOC_RMT_MEM_WORDS_PER_CHANNEL, &led_chan, &led_encoder);
-        rmt_tx_event_callbacks_t cbs = {.on_trans_done = led_strip_done};
-        CHK(rmt_tx_register_event_callbacks(led_chan, &cbs, NULL));
-    } else {
-        CHK(rmt_enable(led_chan));
     }
 
-    led_in_use = true;
-    led_done_fn = donefn;
-    transmit(led_chan, led_encoder, data, size);
+    led_strip_t *strip = led_get_strip(pin);
+    if (!strip)
+        return -100;
+
+    if (strip->pending >= LED_NUM_FRAMES)
+        return -100;
+
+    // fresh channels (never used) are already enabled by setup_strip()
+    if (strip->pending == 0 && strip->last_used)
+        CHK(rmt_enable(strip->chan));
+    strip->last_used = ++use_counter;
+
+    int idx = strip->next_frame;
+    strip->next_frame = (strip->next_frame + 1) % LED_NUM_FRAMES;
+    if (strip->frame_alloc[idx] < size) {
+        jd_free(strip->frames[idx]);
+        strip->frames[idx] = jd_alloc(size);
+        strip->frame_alloc[idx] = size;
+    }
+    memcpy(strip->frames[idx], data, size);
+    strip->frame_size = size;
+
+    strip->pending++;
+    transmit(strip->chan, strip->encoder, strip->frames[idx], size);
+
+    // the caller's buffer is free now; let it prepare the next frame once there's a free slot
+    if (strip->pending < LED_NUM_FRAMES)
+        worker_run(main_worker, call_fn, donefn);
+    else
+        strip->waiting_fn = donefn;
 
     return 0;
-}
\ No newline at end of file
+}
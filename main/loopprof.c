@@ -0,0 +1,127 @@
+#include "jdesp.h"
+
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+
+// Per-phase timing of the main loop, using the CPU cycle counter.
+// Phases exceeding the budget ("loop.budgetUs" in device config, or e.g. "loop.workerBudgetUs"
+// for a single phase) are logged, and statistics
+// (p50/p99/max over the last LOOPPROF_SAMPLES iterations) are reported to dmesg periodically
+// whenever there were budget overruns (or always if "loop.reportS" is set).
+
+#define LOG(msg, ...) DMESG("loop: " msg, ##__VA_ARGS__)
+
+#define LOOPPROF_SAMPLES 128
+#define LOOPPROF_DEFAULT_BUDGET_US 20000
+#define LOOPPROF_DEFAULT_REPORT_S 60
+// don't log more than one overrun per this many us
+#define LOOPPROF_LOG_INTERVAL_US 1000000
+
+typedef struct {
+    uint32_t samples[LOOPPROF_SAMPLES];
+    uint32_t budget;
+    uint32_t max;
+    uint32_t num_samples;
+    uint32_t overruns;
+} phase_stats_t;
+
+static phase_stats_t stats[LOOP_PHASE_NUM];
+static uint8_t curr_phase;
+static uint32_t phase_start;
+static uint32_t cycles_per_us;
+static int64_t last_log, next_report;
+static int64_t report_interval_us;
+static bool always_report;
+
+// per-phase overrides of loop.budgetUs
+static const char *budget_keys[LOOP_PHASE_NUM] = {
+    [LOOP_PHASE_JD_PROCESS] = "loop.jdProcessBudgetUs",
+    [LOOP_PHASE_WORKER] = "loop.workerBudgetUs",
+    [LOOP_PHASE_TCPSOCK] = "loop.tcpsockBudgetUs",
+    [LOOP_PHASE_DMESG] = "loop.dmesgBudgetUs",
+};
+
+static uint32_t read_budget(const char *key, int defl) {
+    int budget = dcfg_get_i32(key, defl);
+    return budget < 0 ? 0 : budget;
+}
+
+static void loopprof_init(void) {
+    cycles_per_us = esp_rom_get_cpu_ticks_per_us();
+    uint32_t budget = read_budget("loop.budgetUs", LOOPPROF_DEFAULT_BUDGET_US);
+    for (int i = 0; i < LOOP_PHASE_NUM; ++i)
+        stats[i].budget = budget_keys[i] ? read_budget(budget_keys[i], budget) : budget;
+    int report_s = dcfg_get_i32("loop.reportS", 0);
+    always_report = report_s > 0;
+    report_interval_us = (int64_t)(always_report ? report_s : LOOPPROF_DEFAULT_REPORT_S) * 1000000;
+    next_report = esp_timer_get_time() + report_interval_us;
+}
+
+void loopprof_phase(uint8_t phase) {
+    uint32_t t = esp_cpu_get_cycle_count();
+
+    if (!cycles_per_us)
+        loopprof_init();
+
+    if (curr_phase != LOOP_PHASE_IDLE) {
+        phase_stats_t *s = &stats[curr_phase];
+        uint32_t us = (t - phase_start) / cycles_per_us;
+        s->samples[s->num_samples++ % LOOPPROF_SAMPLES] = us;
+        if (us > s->max)
+            s->max = us;
+        if (us > s->budget) {
+            s->overruns++;
+            int64_t now_us = esp_timer_get_time();
+            if (now_us - last_log > LOOPPROF_LOG_INTERVAL_US) {
+                last_log = now_us;
+                LOG("%s took %uus (budget %uus)", loop_phase_name(curr_phase), (unsigned)us,
+                    (unsigned)s->budget);
+            }
+        }
+    }
+
+    curr_phase = phase;
+    // re-read, so that our own overhead is not attributed to the next phase
+    phase_start = esp_cpu_get_cycle_count();
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+void loopprof_report(void) {
+    uint32_t *tmp = jd_alloc(sizeof(uint32_t) * LOOPPROF_SAMPLES);
+    for (int i = LOOP_PHASE_IDLE + 1; i < LOOP_PHASE_NUM; ++i) {
+        phase_stats_t *s = &stats[i];
+        unsigned n = s->num_samples < LOOPPROF_SAMPLES ? s->num_samples : LOOPPROF_SAMPLES;
+        if (n == 0)
+            continue;
+        memcpy(tmp, s->samples, n * sizeof(uint32_t));
+        qsort(tmp, n, sizeof(uint32_t), cmp_u32);
+        LOG("%s: p50=%uus p99=%uus max=%uus over=%u", loop_phase_name(i), (unsigned)tmp[n / 2],
+            (unsigned)tmp[n * 99 / 100], (unsigned)s->max, (unsigned)s->overruns);
+    }
+    jd_free(tmp);
+}
+
+void loopprof_process(void) {
+    int64_t now_us = esp_timer_get_time();
+    if (!cycles_per_us || now_us < next_report)
+        return;
+    next_report = now_us + report_interval_us;
+
+    bool any_overruns = false;
+    for (int i = 0; i < LOOP_PHASE_NUM; ++i)
+        if (stats[i].overruns)
+            any_overruns = true;
+
+    if (always_report || any_overruns)
+        loopprof_report();
+
+    for (int i = 0; i < LOOP_PHASE_NUM; ++i) {
+        stats[i].max = 0;
+        stats[i].overruns = 0;
+    }
+}
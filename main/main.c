@@ -20,8 +20,23 @@ uint32_t now;
 static TaskHandle_t main_task;
 static int loop_pending;
 static esp_timer_handle_t main_loop_tick_timer;
+static bool vm_started;
 uint16_t tim_max_sleep;
 
+void boot_mark(const char *phase) {
+    // time since the app started (bootloader not included)
+    DMESG("boot: %s at %ums", phase, (unsigned)(esp_timer_get_time() / 1000));
+}
+
+void boot_run_bg(const char *name, TaskFunction_t fn, void *arg) {
+#if JD_DEFERRED_INIT
+    // a worker each, so that a slow one (eg. SD init with no card) doesn't hold up the others
+    worker_run(worker_start(name, 4096), fn, arg);
+#else
+    fn(arg);
+#endif
+}
+
 static void sync_main_loop_timer(void) {
     static uint16_t max_sleep;
     if (!tim_max_sleep)
@@ -52,6 +67,26 @@ void jd_usb_flush_stdout(void) {
     fflush(stdout);
 }
 
+static const char *phase_names[LOOP_PHASE_NUM] = {"idle", "jd_process", "worker", "tcpsock",
+                                                  "dmesg"};
+
+const char *loop_phase_name(unsigned phase) {
+    if (phase < LOOP_PHASE_NUM)
+        return phase_names[phase];
+    return "?";
+}
+
+static void loop_phase(uint8_t phase) {
+    static uint8_t prev_phase;
+    if (prev_phase != LOOP_PHASE_IDLE)
+        TRACE_END(prev_phase);
+    rtclog_phase(phase);
+    loopprof_phase(phase);
+    if (phase != LOOP_PHASE_IDLE)
+        TRACE_BEGIN(phase, 0);
+    prev_phase = phase;
+}
+
 static void loop_handler(void *event_handler_arg, esp_event_base_t event_base, int32_t event_id,
                          void *event_data) {
     if (!main_task) {
@@ -64,7 +99,7 @@ static void loop_handler(void *event_handler_arg, esp_event_base_t event_base, i
 
         jd_tcpsock_init();
 
-        DMESG("loop init done");
+        boot_mark("loop init done");
     }
 
     loop_pending = 0;
@@ -82,13 +117,31 @@ static void loop_handler(void *event_handler_arg, esp_event_base_t event_base, i
         reboot_to_uf2();
 #endif
 
+    loop_phase(LOOP_PHASE_JD_PROCESS);
     jd_process_everything();
+    pwm_flush();
+    bool vm_running = devsmgr_get_ctx() != NULL;
+    if (!vm_started && vm_running) {
+        vm_started = true;
+        boot_mark("VM started");
+    }
+    fstor_vm_running(vm_running);
 
+    loop_phase(LOOP_PHASE_WORKER);
     worker_do_work(main_worker);
 
+    loop_phase(LOOP_PHASE_TCPSOCK);
     jd_tcpsock_process();
 
+    loop_phase(LOOP_PHASE_DMESG);
     uart_log_dmesg();
+    rtclog_process();
+    trace_process();
+    hotpages_process();
+    irqlat_process();
+    loopprof_process();
+
+    loop_phase(LOOP_PHASE_IDLE);
 
     // re-post ourselves immediately if more frames to process
     if (jd_rx_has_frame())
@@ -97,11 +150,23 @@ static void loop_handler(void *event_handler_arg, esp_event_base_t event_base, i
         sync_main_loop_timer();
 }
 
+static void i2c_scan(void *arg) {
+    i2c_scan_begin();
+    jd_scan_all();
+    i2c_scan_end();
+    boot_mark("I2C scan done");
+}
+
 void app_init_services(void) {
     devs_service_full_init();
 
     if (i2c_init() == 0) {
-        jd_scan_all();
+#if JD_DEFERRED_INIT
+        // sensor services show up a bit later, while the VM is already starting
+        worker_run(main_worker, i2c_scan, NULL);
+#else
+        i2c_scan(NULL);
+#endif
         // i2cserv_init();
     }
 
@@ -109,10 +174,44 @@ void app_init_services(void) {
     jd_wifi_rssi(); // make sure WiFi module links
 #endif
 
-    adc_can_read_pin(0); // link ADC
+    adc_stream_init();
     jd_spi_is_ready(); // link SPI
 }
 
+static bool sd_mounted;
+static volatile bool sd_init_done;
+
+static void sd_ready(void *arg) {
+    if (sd_mounted)
+        jd_lstore_init();
+    // report any crash from previous boot, now that stdout goes to lstore and USB
+    rtclog_report();
+}
+
+static void sd_init(void *arg) {
+    sd_mounted = init_sdcard();
+    sd_init_done = true;
+    boot_mark("SD init done");
+#if JD_DEFERRED_INIT
+    // lstore is used from the main task
+    worker_run(main_worker, sd_ready, NULL);
+#else
+    sd_ready(NULL);
+#endif
+}
+
+void boot_wait_sd(void) {
+    if (sd_init_done)
+        return;
+    int64_t t0 = esp_timer_get_time();
+    while (!sd_init_done) {
+        // the main task is watched; others just ignore this
+        esp_task_wdt_reset();
+        vTaskDelay(1);
+    }
+    DMESG("waited %ums for SD init", (unsigned)((esp_timer_get_time() - t0) / 1000));
+}
+
 static int log_writefn(void *cookie, const char *data, int size) {
     jd_lstore_append_frag(0, JD_LSTORE_TYPE_LOG, data, size);
     jd_dmesg_write(data, size);
@@ -139,7 +238,6 @@ void app_main(void) {
 
     usb_pre_init();
     jd_seed_random(esp_random());
-    init_sdcard();
 
 #if 0
     esp_log_level_set("sdmmc_init", ESP_LOG_VERBOSE);
@@ -153,6 +251,8 @@ void app_main(void) {
     static char stdout_buf[128];
     setvbuf(stdout, stdout_buf, _IOLBF, sizeof(stdout_buf));
 
+    rtclog_init();
+
     flash_init();
 
     usb_init();
@@ -161,6 +261,10 @@ void app_main(void) {
 
     main_worker = worker_alloc();
 
+    // SD card init can take a while (esp. with no card), so with JD_DEFERRED_INIT it runs in
+    // background; lstore only captures the log from when it's done
+    boot_run_bg("sd", sd_init, NULL);
+
     esp_event_loop_create_default();
 
     jd_settings_get_bin("no_such_setting", NULL, 0); // force flash init
@@ -180,7 +284,7 @@ void app_main(void) {
     CHK(esp_timer_create(&args, &main_loop_tick_timer));
     sync_main_loop_timer();
 
-    DMESG("app_main mostly done");
+    boot_mark("app_main mostly done");
 
     CHK(esp_event_handler_instance_register(JD_EVENT, 1, loop_handler, NULL, NULL));
     loop_pending = 0; // someone might have tried to post it before, but it would be ignored without
@@ -0,0 +1,195 @@
+#include "jdesp.h"
+
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+
+// Post-mortem record kept in RTC memory, which survives panics, watchdog and brownout resets
+// (but not power-on). It's printed to stdout (and thus SD lstore and USB) on next boot.
+
+#define RTCLOG_MAGIC 0xb7c3a85e
+#define RTCLOG_LOG_SIZE 1024
+#define RTCLOG_TRACE_SIZE 16
+// phases taking at least this long are recorded in the trace
+#define RTCLOG_SLOW_PHASE_MS 20
+
+typedef struct {
+    uint32_t start_ms;
+    uint16_t duration_ms;
+    uint8_t phase;
+    uint8_t reserved;
+} rtclog_trace_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t boot_no;
+    uint32_t uptime_ms;
+    uint32_t min_free_heap;
+    uint32_t phase_start_ms;
+    uint8_t phase;
+    uint8_t in_panic;
+    uint8_t log_wrapped;
+    uint8_t trace_ptr;
+    uint16_t log_ptr;
+    char panic_task[configMAX_TASK_NAME_LEN];
+    rtclog_trace_t trace[RTCLOG_TRACE_SIZE];
+    char log[RTCLOG_LOG_SIZE];
+} rtclog_t;
+
+static RTC_NOINIT_ATTR rtclog_t rtclog;
+static rtclog_t *prev_boot;
+static uint32_t dmesg_ptr;
+
+static uint32_t uptime_ms(void) {
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+static void log_append(const void *data, unsigned size) {
+    const char *p = data;
+    while (size--) {
+        rtclog.log[rtclog.log_ptr++] = *p++;
+        if (rtclog.log_ptr >= RTCLOG_LOG_SIZE) {
+            rtclog.log_ptr = 0;
+            rtclog.log_wrapped = 1;
+        }
+    }
+}
+
+static bool is_crash_reset(esp_reset_reason_t reason) {
+    switch (reason) {
+    case ESP_RST_PANIC:
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+    case ESP_RST_BROWNOUT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void print_log(const rtclog_t *r) {
+    // start with the oldest data; if wrapped, skip the partial first line
+    char *tmp = jd_alloc(RTCLOG_LOG_SIZE + 1);
+    unsigned len = 0;
+    if (r->log_wrapped) {
+        len = RTCLOG_LOG_SIZE - r->log_ptr;
+        memcpy(tmp, r->log + r->log_ptr, len);
+    }
+    memcpy(tmp + len, r->log, r->log_ptr);
+    len += r->log_ptr;
+    tmp[len] = 0;
+
+    char *line = tmp;
+    if (r->log_wrapped) {
+        char *nl = strchr(line, '\n');
+        line = nl ? nl + 1 : tmp + len;
+    }
+    while (*line) {
+        char *nl = strchr(line, '\n');
+        if (nl)
+            *nl = 0;
+        printf("PM| %s\n", line);
+        if (!nl)
+            break;
+        line = nl + 1;
+    }
+    jd_free(tmp);
+}
+
+static void report(const rtclog_t *r, esp_reset_reason_t reason) {
+    printf("PM: post-mortem of boot #%u: reset reason %d%s\n", (unsigned)r->boot_no,
+           reason, r->in_panic ? " (panic)" : "");
+    printf("PM: uptime %ums, min. free heap %u bytes\n", (unsigned)r->uptime_ms,
+           (unsigned)r->min_free_heap);
+    if (r->in_panic)
+        printf("PM: panic in task '%s'\n", r->panic_task);
+    printf("PM: main loop in %s for %ums\n", loop_phase_name(r->phase),
+           (unsigned)(r->uptime_ms - r->phase_start_ms));
+
+    for (unsigned i = 0; i < RTCLOG_TRACE_SIZE; ++i) {
+        const rtclog_trace_t *t = &r->trace[(r->trace_ptr + i) % RTCLOG_TRACE_SIZE];
+        if (t->duration_ms)
+            printf("PM: slow %s at %ums: %ums\n", loop_phase_name(t->phase), (unsigned)t->start_ms,
+                   t->duration_ms);
+    }
+
+    print_log(r);
+    printf("PM: end\n");
+}
+
+void rtclog_init(void) {
+    esp_reset_reason_t reason = esp_reset_reason();
+    uint32_t boot_no = 0;
+
+    // RTC memory isn't cleared on reset, so the magic can survive a partially written record
+    if (rtclog.magic == RTCLOG_MAGIC &&
+        (rtclog.log_ptr >= RTCLOG_LOG_SIZE || rtclog.trace_ptr >= RTCLOG_TRACE_SIZE))
+        rtclog.magic = 0;
+
+    if (rtclog.magic == RTCLOG_MAGIC && reason != ESP_RST_POWERON) {
+        boot_no = rtclog.boot_no + 1;
+        if (rtclog.in_panic || is_crash_reset(reason)) {
+            // printed by rtclog_report(), once lstore is up
+            prev_boot = jd_alloc(sizeof(rtclog_t));
+            *prev_boot = rtclog;
+        }
+    }
+
+    memset(&rtclog, 0, sizeof(rtclog));
+    rtclog.boot_no = boot_no;
+    rtclog.magic = RTCLOG_MAGIC;
+}
+
+void rtclog_report(void) {
+    if (!prev_boot)
+        return;
+    report(prev_boot, esp_reset_reason());
+    jd_free(prev_boot);
+    prev_boot = NULL;
+}
+
+void rtclog_process(void) {
+    uint8_t buf[64];
+    int n;
+    while ((n = jd_dmesg_read(buf, sizeof(buf), &dmesg_ptr)) > 0)
+        log_append(buf, n);
+    rtclog.min_free_heap = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    rtclog.uptime_ms = uptime_ms();
+}
+
+void rtclog_phase(uint8_t phase) {
+    uint32_t t = uptime_ms();
+    uint32_t d = t - rtclog.phase_start_ms;
+    if (d >= RTCLOG_SLOW_PHASE_MS) {
+        rtclog_trace_t *e = &rtclog.trace[rtclog.trace_ptr];
+        e->start_ms = rtclog.phase_start_ms;
+        e->duration_ms = d > 0xffff ? 0xffff : d;
+        e->phase = rtclog.phase;
+        rtclog.trace_ptr = (rtclog.trace_ptr + 1) % RTCLOG_TRACE_SIZE;
+    }
+    rtclog.phase = phase;
+    rtclog.phase_start_ms = t;
+    rtclog.uptime_ms = t;
+}
+
+void rtclog_panic(void) {
+    if (rtclog.magic != RTCLOG_MAGIC)
+        return;
+
+    rtclog.in_panic = 1;
+    rtclog.uptime_ms = uptime_ms();
+    const char *name = pcTaskGetName(NULL);
+    strlcpy(rtclog.panic_task, name ? name : "?", sizeof(rtclog.panic_task));
+
+    // take the freshest tail of dmesg directly; the mirror may be behind
+    unsigned len = codalLogStore.ptr;
+    const char *src = codalLogStore.buffer;
+    if (len > RTCLOG_LOG_SIZE) {
+        src += len - RTCLOG_LOG_SIZE;
+        len = RTCLOG_LOG_SIZE;
+    }
+    memcpy(rtclog.log, src, len);
+    rtclog.log_ptr = len % RTCLOG_LOG_SIZE;
+    rtclog.log_wrapped = len == RTCLOG_LOG_SIZE;
+}
@@ -0,0 +1,198 @@
+#include "jdesp.h"
+
+#include "sdmmc_cmd.h"
+#include "diskio_impl.h"
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+// Write-back cache for the SD card FATFS drive.
+// Writes to a run of contiguous sectors (typically the tail of the lstore log file, rewritten
+// on every append) are kept in RAM and written out as one multi-block write, either when a
+// non-contiguous write comes in, or from a periodic flush on the main task.
+// CTRL_SYNC from FATFS is deferred to that flush. The cache is also flushed on esp_restart()
+// and on panic (see __wrap_panic_restart()); there the lock is bypassed.
+
+#define LOG(msg, ...) DMESG("sdcache: " msg, ##__VA_ARGS__)
+
+#define SDCACHE_SECTORS 16
+#define SDCACHE_FLUSH_MS 1000
+
+static sdmmc_card_t *card;
+static uint8_t *cache_buf;
+static uint32_t cache_start, cache_count;
+static unsigned sector_size;
+static SemaphoreHandle_t cache_lock;
+static esp_timer_handle_t flush_timer;
+static bool flush_pending;
+static bool in_panic;
+
+// in panic, other tasks are stopped, and the lock may be held by one of them forever
+static void cache_lock_take(void) {
+    if (!in_panic)
+        xSemaphoreTake(cache_lock, portMAX_DELAY);
+}
+
+static void cache_lock_give(void) {
+    if (!in_panic)
+        xSemaphoreGive(cache_lock);
+}
+
+static DRESULT flush_locked(void) {
+    if (!cache_count)
+        return RES_OK;
+    esp_err_t r = sdmmc_write_sectors(card, cache_buf, cache_start, cache_count);
+    if (r) {
+        // keep the data, and retry on next flush
+        LOG("write %u+%u failed: %d", (unsigned)cache_start, (unsigned)cache_count, r);
+        return RES_ERROR;
+    }
+    cache_count = 0;
+    return RES_OK;
+}
+
+void sdcache_flush(void) {
+    if (!card)
+        return;
+    cache_lock_take();
+    flush_locked();
+    cache_lock_give();
+}
+
+void sdcache_panic_begin(void) {
+    in_panic = true;
+}
+
+void sdcache_panic_flush(void) {
+    in_panic = true;
+    if (card && cache_count)
+        sdmmc_write_sectors(card, cache_buf, cache_start, cache_count);
+}
+
+static void flush_on_main(void *arg) {
+    flush_pending = false;
+    sdcache_flush();
+}
+
+static void flush_timer_cb(void *arg) {
+    // do the actual write on the main task, which is also where FATFS is used from
+    if (cache_count && main_worker && !flush_pending) {
+        flush_pending = true;
+        if (worker_run(main_worker, flush_on_main, NULL) != 0)
+            flush_pending = false;
+    }
+}
+
+static DSTATUS sdc_initialize(BYTE pdrv) {
+    return 0;
+}
+
+static DSTATUS sdc_status(BYTE pdrv) {
+    return 0;
+}
+
+static DRESULT sdc_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count) {
+    DRESULT res = RES_OK;
+    cache_lock_take();
+
+    uint32_t lo = sector > cache_start ? sector : cache_start;
+    uint32_t hi = sector + count < cache_start + cache_count ? sector + count
+                                                            : cache_start + cache_count;
+
+    // skip the card if the whole read is in the cache
+    if (!(cache_count && lo == sector && hi == sector + count)) {
+        esp_err_t r = sdmmc_read_sectors(card, buff, sector, count);
+        if (r) {
+            LOG("read %u+%u failed: %d", (unsigned)sector, count, r);
+            res = RES_ERROR;
+        }
+    }
+
+    // cached sectors are newer than what's on the card
+    if (res == RES_OK && cache_count && lo < hi)
+        memcpy(buff + (lo - sector) * sector_size, cache_buf + (lo - cache_start) * sector_size,
+               (hi - lo) * sector_size);
+
+    cache_lock_give();
+    return res;
+}
+
+static DRESULT sdc_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count) {
+    DRESULT res = RES_OK;
+    cache_lock_take();
+
+    if (cache_count && sector >= cache_start && sector <= cache_start + cache_count &&
+        sector + count <= cache_start + SDCACHE_SECTORS) {
+        // overwrites or extends the cached run
+        memcpy(cache_buf + (sector - cache_start) * sector_size, buff, count * sector_size);
+        if (sector + count > cache_start + cache_count)
+            cache_count = sector + count - cache_start;
+    } else {
+        res = flush_locked();
+        if (res == RES_OK) {
+            if (count >= SDCACHE_SECTORS) {
+                esp_err_t r = sdmmc_write_sectors(card, buff, sector, count);
+                if (r) {
+                    LOG("write %u+%u failed: %d", (unsigned)sector, count, r);
+                    res = RES_ERROR;
+                }
+            } else {
+                memcpy(cache_buf, buff, count * sector_size);
+                cache_start = sector;
+                cache_count = count;
+            }
+        }
+    }
+
+    cache_lock_give();
+    return res;
+}
+
+static DRESULT sdc_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
+    switch (cmd) {
+    case CTRL_SYNC:
+        // deferred to the flush timer
+        return RES_OK;
+    case GET_SECTOR_COUNT:
+        *((DWORD *)buff) = card->csd.capacity;
+        return RES_OK;
+    case GET_SECTOR_SIZE:
+        *((WORD *)buff) = card->csd.sector_size;
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *((DWORD *)buff) = 1; // unknown
+        return RES_OK;
+    case CTRL_TRIM:
+        return RES_OK;
+    }
+    return RES_PARERR;
+}
+
+static const ff_diskio_impl_t sdcache_impl = {
+    .init = &sdc_initialize,
+    .status = &sdc_status,
+    .read = &sdc_read,
+    .write = &sdc_write,
+    .ioctl = &sdc_ioctl,
+};
+
+void sdcache_init(uint8_t pdrv, void *sdcard) {
+    card = sdcard;
+    sector_size = card->csd.sector_size;
+    cache_buf = heap_caps_malloc(SDCACHE_SECTORS * sector_size, MALLOC_CAP_DMA);
+    JD_ASSERT(cache_buf != NULL);
+    cache_lock = xSemaphoreCreateMutex();
+
+    ff_diskio_register(pdrv, &sdcache_impl);
+
+    esp_timer_create_args_t args = {
+        .callback = flush_timer_cb,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "sdcache",
+    };
+    CHK(esp_timer_create(&args, &flush_timer));
+    CHK(esp_timer_start_periodic(flush_timer, SDCACHE_FLUSH_MS * 1000));
+    CHK(esp_register_shutdown_handler(sdcache_flush));
+
+    LOG("%u sectors, flush every %ums", SDCACHE_SECTORS, SDCACHE_FLUSH_MS);
+}
@@ -7,6 +7,8 @@
 #include "driver/sdmmc_host.h"
 #include "diskio_impl.h"
 #include "diskio_sdmmc.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
 
 static const char *TAG = "sd";
 
@@ -90,28 +92,63 @@ void spi_bb_rx(void *data, unsigned len) {
 
 void panic_dump_dmesg(void);
 
-void init_sdcard(void) {
-    esp_err_t ret;
+// SPI clock to try first; falls back to SDMMC_FREQ_DEFAULT (20MHz) if the card doesn't come up
+#define SD_DEFAULT_MHZ 40
 
-    sdmmc_card_t *card;
+static void log_card(sdmmc_card_t *card, const char *mode) {
+    DMESG("SD card: %s, %u MB, %ukHz%s", mode,
+          (unsigned)((uint64_t)card->csd.capacity * card->csd.sector_size >> 20),
+          (unsigned)card->max_freq_khz, card->is_ddr ? " DDR" : "");
+}
 
-    pin_miso = dcfg_get_pin("sd.pinMISO");
-    pin_mosi = dcfg_get_pin("sd.pinMOSI");
-    pin_sck = dcfg_get_pin("sd.pinSCK");
-    pin_cs = dcfg_get_pin("sd.pinCS");
+#if SOC_SDMMC_HOST_SUPPORTED
+// 4-bit SD bus mode: pinSCK=CLK, pinMOSI=CMD, pinMISO=D0, pinD1, pinD2, pinCS=D3
+static sdmmc_card_t *init_sdmmc(void) {
+    uint8_t pin_d1 = dcfg_get_pin("sd.pinD1");
+    uint8_t pin_d2 = dcfg_get_pin("sd.pinD2");
+    if (pin_d1 == NO_PIN || pin_d2 == NO_PIN)
+        return NULL;
+
+    sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
+    slot_config.width = 4;
+    slot_config.flags |= SDMMC_SLOT_FLAG_INTERNAL_PULLUP;
+
+#if SOC_SDMMC_USE_GPIO_MATRIX
+    slot_config.clk = pin_sck;
+    slot_config.cmd = pin_mosi;
+    slot_config.d0 = pin_miso;
+    slot_config.d1 = pin_d1;
+    slot_config.d2 = pin_d2;
+    slot_config.d3 = pin_cs;
+#else
+    // ESP32 slot 1 pins are fixed in IOMUX
+    if (pin_sck != 14 || pin_mosi != 15 || pin_miso != 2 || pin_d1 != 4 || pin_d2 != 12 ||
+        pin_cs != 13) {
+        ESP_LOGW(TAG, "SDMMC needs CLK=14 CMD=15 D0=2 D1=4 D2=12 D3=13; using SPI");
+        return NULL;
+    }
+#endif
 
-    if (pin_miso == NO_PIN || pin_mosi == NO_PIN || pin_sck == NO_PIN || pin_cs == NO_PIN) {
-        ESP_LOGI(TAG, "skipping SD card - no config");
-        return;
+    sdmmc_host_t host = SDMMC_HOST_DEFAULT();
+    host.max_freq_khz = SDMMC_FREQ_HIGHSPEED;
+
+    CHK(host.init());
+    CHK(sdmmc_host_init_slot(host.slot, &slot_config));
+
+    sdmmc_card_t *card = jd_alloc(sizeof(sdmmc_card_t));
+    if (sdmmc_card_init(&host, card) != 0) {
+        ESP_LOGW(TAG, "SDMMC init failed; using SPI");
+        jd_free(card);
+        host.deinit();
+        return NULL;
     }
 
-#if defined(CONFIG_IDF_TARGET_ESP32C3)
-    // 9 is a boot pin connected to button - we should not actively drive it high
-    JD_ASSERT(pin_cs != 9 && pin_sck != 9 && pin_mosi != 9);
+    log_card(card, "SDMMC 4-bit");
+    return card;
+}
 #endif
 
-    ESP_LOGI(TAG, "Initializing SD card");
-
+static sdmmc_card_t *init_sdspi(void) {
     sdmmc_host_t host = SDSPI_HOST_DEFAULT();
     spi_bus_config_t bus_cfg = {
         .mosi_io_num = pin_mosi,
@@ -119,7 +156,8 @@ void init_sdcard(void) {
         .sclk_io_num = pin_sck,
         .quadwp_io_num = -1,
         .quadhd_io_num = -1,
-        .max_transfer_sz = 4000,
+        // room for multi-block transfers of a few sectors in one DMA transaction
+        .max_transfer_sz = 16 * 1024,
     };
 
     CHK(spi_bus_initialize(host.slot, &bus_cfg, SPI_DMA_CHAN));
@@ -128,26 +166,97 @@ void init_sdcard(void) {
     slot_config.gpio_cs = pin_cs;
     slot_config.host_id = host.slot;
 
+    CHK(host.init());
+
+    sdmmc_card_t *card = jd_alloc(sizeof(sdmmc_card_t));
+
+    int khz = dcfg_get_i32("sd.maxMHz", SD_DEFAULT_MHZ) * 1000;
+    for (;;) {
+        host.max_freq_khz = khz;
+        CHK(sdspi_host_init_device(&slot_config, &host.slot));
+        if (sdmmc_card_init(&host, card) == 0)
+            break;
+        sdspi_host_remove_device(host.slot);
+        if (khz <= SDMMC_FREQ_DEFAULT) {
+            jd_free(card);
+            return NULL;
+        }
+        ESP_LOGW(TAG, "SD card failed at %dkHz, retrying slower", khz);
+        khz = SDMMC_FREQ_DEFAULT;
+    }
+
+    log_card(card, "SPI");
+    return card;
+}
+
+#if JD_SD_BENCHMARK
+// read-only, so it's safe to run on cards with data
+static void sd_benchmark(sdmmc_card_t *card) {
+    const unsigned chunk = 32, total = 2048; // sectors
+    uint8_t *buf = heap_caps_malloc(chunk * 512, MALLOC_CAP_DMA);
+    if (!buf)
+        return;
+
+    int64_t t0 = esp_timer_get_time();
+    for (unsigned s = 0; s < total; s += chunk)
+        CHK(sdmmc_read_sectors(card, buf, s, chunk));
+    int64_t seq = esp_timer_get_time() - t0;
+
+    const unsigned nrand = 200;
+    unsigned nsect = card->csd.capacity;
+    t0 = esp_timer_get_time();
+    for (unsigned i = 0; i < nrand; ++i)
+        CHK(sdmmc_read_sectors(card, buf, (i * 2654435761U) % nsect, 1));
+    int64_t rnd = esp_timer_get_time() - t0;
+
+    DMESG("SD bench: seq read %u kB/s, random 512B read %u IOPS",
+          (unsigned)(total * 512 * 1000000LL / 1024 / seq), (unsigned)(nrand * 1000000LL / rnd));
+    heap_caps_free(buf);
+}
+#endif
+
+bool init_sdcard(void) {
+    sdmmc_card_t *card = NULL;
+
+    pin_miso = dcfg_get_pin("sd.pinMISO");
+    pin_mosi = dcfg_get_pin("sd.pinMOSI");
+    pin_sck = dcfg_get_pin("sd.pinSCK");
+    pin_cs = dcfg_get_pin("sd.pinCS");
+
+    if (pin_miso == NO_PIN || pin_mosi == NO_PIN || pin_sck == NO_PIN || pin_cs == NO_PIN) {
+        ESP_LOGI(TAG, "skipping SD card - no config");
+        return false;
+    }
+
+#if defined(CONFIG_IDF_TARGET_ESP32C3)
+    // 9 is a boot pin connected to button - we should not actively drive it high
+    JD_ASSERT(pin_cs != 9 && pin_sck != 9 && pin_mosi != 9);
+#endif
+
+    ESP_LOGI(TAG, "Initializing SD card");
+
     BYTE pdrv = FF_DRV_NOT_USED;
     CHK(ff_diskio_get_drive(&pdrv));
     JD_ASSERT(pdrv == 0);
 
-    card = jd_alloc(sizeof(sdmmc_card_t));
-
-    CHK(host.init());
-
-    CHK(sdspi_host_init_device(&slot_config, &host.slot));
+#if SOC_SDMMC_HOST_SUPPORTED
+    card = init_sdmmc();
+#endif
+    if (!card)
+        card = init_sdspi();
 
-    ret = sdmmc_card_init(&host, card);
-    if (ret != 0) {
-        jd_free(card);
+    if (!card) {
         ESP_LOGW(TAG, "Failed to initialize SD card");
-        return;
+        return false;
     }
 
-    ff_diskio_register_sdmmc(pdrv, card);
+#if JD_SD_BENCHMARK
+    sd_benchmark(card);
+#endif
+
+    sdcache_init(pdrv, card);
 
     ESP_LOGI(TAG, "SD card initialized");
 
-    jd_lstore_init();
+    return true;
 }
@@ -330,10 +330,14 @@ static void worker_main(void *arg) {
             continue;
         switch (cmd.cmd) {
         case JD_CONN_EV_OPEN:
+            TRACE_BEGIN(TRACE_SOCK_OPEN, cmd.open.port);
             process_open(&cmd);
+            TRACE_END(TRACE_SOCK_OPEN);
             break;
         case JD_CONN_EV_MESSAGE:
+            TRACE_BEGIN(TRACE_SOCK_WRITE, cmd.write.size);
             process_write(&cmd);
+            TRACE_END(TRACE_SOCK_WRITE);
             break;
         default:
             JD_PANIC();
@@ -2,9 +2,16 @@
 #include "jd_drivers.h"
 #include "driver/spi_master.h"
 #include "hal/spi_hal.h"
+#include "soc/soc_caps.h"
 #include "services/interfaces/jd_spi.h"
 
+// Transfers are split into DMA transactions of at most BLOCK_SIZE, and up to NUM_SLOTS
+// of these are queued at once, so that the DMA engine runs back-to-back.
 #define BLOCK_SIZE 4096
+#define NUM_SLOTS 4
+#define MAX_XFER_SIZE (16 * BLOCK_SIZE)
+// the bus may be held by another driver (e.g., SD card on the same host); don't stall the main loop
+#define BUS_WAIT_TICKS 2
 
 static int mappin(uint8_t pin) {
     if (pin == NO_PIN)
@@ -13,82 +20,195 @@ static int mappin(uint8_t pin) {
 }
 
 #define MY_SPI_HOST SPI2_HOST // seems OK on C3, S2 and ESP32
+#define MAX_DEVICES SOC_SPI_PERIPH_CS_NUM(MY_SPI_HOST)
 
-static spi_device_handle_t spi;
-static spi_transaction_t trans;
+// Devices (mode and clock) attached to the bus; switching between them only changes the current
+// handle, while the bus itself is kept as long as pins don't change.
+// There is no hardware CS: jd_spi_cfg_t has no CS pin, and callers drive CS as a GPIO.
+typedef struct {
+    spi_device_handle_t handle;
+    uint32_t hz;
+    uint32_t last_used;
+    uint8_t mode;
+} spi_dev_t;
+
+static spi_dev_t devices[MAX_DEVICES];
+static uint32_t dev_use_cnt;
+static bool bus_inited;
+
+static spi_device_handle_t spi; // current device
+static spi_transaction_t poll_trans;
+static spi_transaction_t slots[NUM_SLOTS];
 static bool spi_in_use;
+static jd_spi_cfg_t spi_cfg;
+
+// current transfer
+static const uint8_t *xfer_tx;
+static uint8_t *xfer_rx;
+static unsigned xfer_left;
+static uint8_t slots_queued, next_slot;
+static cb_t xfer_done_fn;
+
+static int queue_more(void) {
+    while (xfer_left && slots_queued < NUM_SLOTS) {
+        unsigned len = xfer_left < BLOCK_SIZE ? xfer_left : BLOCK_SIZE;
+        spi_transaction_t *t = &slots[next_slot];
+        memset(t, 0, sizeof(*t));
+        t->length = 8 * len;
+        t->tx_buffer = xfer_tx;
+        t->rx_buffer = xfer_rx;
+        t->user = t;
+        int ret = spi_device_queue_trans(spi, t, 0);
+        if (ret != 0)
+            return ret;
+        next_slot = (next_slot + 1) % NUM_SLOTS;
+        slots_queued++;
+        xfer_left -= len;
+        if (xfer_tx)
+            xfer_tx += len;
+        if (xfer_rx)
+            xfer_rx += len;
+    }
+    return 0;
+}
 
 static void jd_spi_done_cb_outside_isr(spi_transaction_t *transp) {
     JD_ASSERT(spi_in_use);
+    JD_ASSERT(slots_queued > 0);
     spi_transaction_t *rtrans;
     int ret = spi_device_get_trans_result(spi, &rtrans, 0);
     JD_ASSERT(ret == 0);
     JD_ASSERT(rtrans == transp);
-    cb_t cb = transp->user;
-    spi_in_use = false;
-    cb();
+    slots_queued--;
+
+    // refill the queue before anything else, to keep DMA busy
+    ret = queue_more();
+    JD_ASSERT(ret == 0);
+
+    if (slots_queued == 0) {
+        JD_ASSERT(xfer_left == 0);
+        cb_t cb = xfer_done_fn;
+        spi_in_use = false;
+        cb();
+    }
 }
 
 static void jd_spi_done_cb(spi_transaction_t *transp) {
-    JD_ASSERT(transp == &trans);
     if (transp->user == NULL)
         return; // polling transaction
     JD_ASSERT(spi_in_use);
     tim_worker_run((TaskFunction_t)jd_spi_done_cb_outside_isr, transp);
 }
 
-int jd_spi_init(const jd_spi_cfg_t *cfg) {
-    if (spi_in_use)
-        return -100;
-
-    if (spi) {
-        spi_bus_remove_device(spi);
-        spi = NULL;
+static void bus_free(void) {
+    for (int i = 0; i < MAX_DEVICES; ++i) {
+        if (devices[i].handle)
+            spi_bus_remove_device(devices[i].handle);
+        memset(&devices[i], 0, sizeof(spi_dev_t));
+    }
+    spi = NULL;
+    if (bus_inited) {
         spi_bus_free(MY_SPI_HOST);
+        bus_inited = false;
     }
+}
 
-    spi_bus_config_t buscfg = {
-        .miso_io_num = mappin(cfg->miso),
-        .mosi_io_num = mappin(cfg->mosi),
-        .sclk_io_num = mappin(cfg->sck),
-        .quadwp_io_num = -1,
-        .quadhd_io_num = -1,
-        .max_transfer_sz = BLOCK_SIZE,
-    };
+static spi_dev_t *get_device(const jd_spi_cfg_t *cfg) {
+    spi_dev_t *lru = NULL;
+    for (int i = 0; i < MAX_DEVICES; ++i) {
+        spi_dev_t *d = &devices[i];
+        if (d->handle && d->mode == cfg->mode && d->hz == cfg->hz)
+            return d;
+        if (!lru || !d->handle || (lru->handle && d->last_used < lru->last_used))
+            lru = d;
+    }
 
-    DMESG("SPI init: miso=%d mosi=%d sck=%d hz=%u", buscfg.miso_io_num, buscfg.mosi_io_num,
-          buscfg.sclk_io_num, (unsigned)cfg->hz);
+    if (lru->handle) {
+        DMESG("SPI evict device: hz=%u mode=%d", (unsigned)lru->hz, lru->mode);
+        spi_bus_remove_device(lru->handle);
+        lru->handle = NULL;
+    }
 
     spi_device_interface_config_t devcfg = {
         .clock_speed_hz = cfg->hz,
         .mode = cfg->mode,
         .spics_io_num = -1,
-        .queue_size = 2,
+        .queue_size = NUM_SLOTS,
         .post_cb = jd_spi_done_cb,
     };
 
-    int r;
+    int r = spi_bus_add_device(MY_SPI_HOST, &devcfg, &lru->handle);
+    if (r) {
+        DMESG("SPI add device failed: %d", r);
+        lru->handle = NULL;
+        return NULL;
+    }
 
-    r = spi_bus_initialize(MY_SPI_HOST, &buscfg, SPI_DMA_CH_AUTO);
-    if (r)
-        return r;
+    DMESG("SPI device: hz=%u mode=%d", (unsigned)cfg->hz, cfg->mode);
 
-    r = spi_bus_add_device(MY_SPI_HOST, &devcfg, &spi);
-    if (r) {
+    lru->mode = cfg->mode;
+    lru->hz = cfg->hz;
+    return lru;
+}
+
+int jd_spi_init(const jd_spi_cfg_t *cfg) {
+    if (spi_in_use)
+        return -100;
+
+    // the SD card (in SPI mode) sets up MY_SPI_HOST from the background; don't race it
+    boot_wait_sd();
+
+    if (bus_inited &&
+        (cfg->miso != spi_cfg.miso || cfg->mosi != spi_cfg.mosi || cfg->sck != spi_cfg.sck))
+        bus_free();
+
+    if (!bus_inited) {
+        spi_bus_config_t buscfg = {
+            .miso_io_num = mappin(cfg->miso),
+            .mosi_io_num = mappin(cfg->mosi),
+            .sclk_io_num = mappin(cfg->sck),
+            .quadwp_io_num = -1,
+            .quadhd_io_num = -1,
+            .max_transfer_sz = BLOCK_SIZE,
+        };
+
+        DMESG("SPI init: miso=%d mosi=%d sck=%d", buscfg.miso_io_num, buscfg.mosi_io_num,
+              buscfg.sclk_io_num);
+
+        int r = spi_bus_initialize(MY_SPI_HOST, &buscfg, SPI_DMA_CH_AUTO);
+        if (r)
+            return r;
+        bus_inited = true;
+    }
+
+    spi_dev_t *dev = get_device(cfg);
+    if (!dev) {
         spi = NULL;
-        spi_bus_free(MY_SPI_HOST);
-        return r;
+        return -1;
     }
 
+    dev->last_used = ++dev_use_cnt;
+    spi = dev->handle;
+    spi_cfg = *cfg;
+
     return 0;
 }
 
+const jd_spi_cfg_t *spi_current_cfg(void) {
+    return spi ? &spi_cfg : NULL;
+}
+
+bool spi_cfg_equal(const jd_spi_cfg_t *a, const jd_spi_cfg_t *b) {
+    return a->miso == b->miso && a->mosi == b->mosi && a->sck == b->sck && a->mode == b->mode &&
+           a->hz == b->hz;
+}
+
 bool jd_spi_is_ready(void) {
     return spi != NULL && !spi_in_use;
 }
 
 unsigned jd_spi_max_block_size(void) {
-    return BLOCK_SIZE;
+    return MAX_XFER_SIZE;
 }
 
 static void call_fn(void *f) {
@@ -104,7 +224,7 @@ int jd_spi_xfer(const void *txdata, void *rxdata, unsigned numbytes, cb_t done_f
     if (!jd_spi_is_ready())
         return -1;
 
-    if (numbytes > BLOCK_SIZE)
+    if (numbytes > MAX_XFER_SIZE)
         return -2;
 
     if (numbytes == 0)
@@ -112,25 +232,34 @@ int jd_spi_xfer(const void *txdata, void *rxdata, unsigned numbytes, cb_t done_f
 
     JD_ASSERT(txdata || rxdata);
 
-    memset(&trans, 0, sizeof(trans));
-    trans.length = 8 * numbytes;
-    trans.tx_buffer = txdata;
-    trans.rx_buffer = rxdata;
-    trans.user = done_fn;
-
     int ret;
 
     if (numbytes <= 4) {
-        trans.user = NULL;
-        ret = spi_device_polling_transmit(spi, &trans);
+        memset(&poll_trans, 0, sizeof(poll_trans));
+        poll_trans.length = 8 * numbytes;
+        poll_trans.tx_buffer = txdata;
+        poll_trans.rx_buffer = rxdata;
+        ret = spi_device_polling_start(spi, &poll_trans, BUS_WAIT_TICKS);
+        if (ret == ESP_ERR_TIMEOUT)
+            return -3; // bus busy; try again later
+        if (ret == 0)
+            ret = spi_device_polling_end(spi, portMAX_DELAY);
         if (ret == 0)
             goto sync_ok;
         return ret;
     } else {
         spi_in_use = true;
-        ret = spi_device_queue_trans(spi, &trans, 0);
-        if (ret != 0)
+        xfer_tx = txdata;
+        xfer_rx = rxdata;
+        xfer_left = numbytes;
+        xfer_done_fn = done_fn;
+        ret = queue_more();
+        if (ret != 0) {
+            // the queue is empty when not in use, so this can only fail on the first slot
+            JD_ASSERT(slots_queued == 0);
+            xfer_left = 0;
             spi_in_use = false;
+        }
         return ret;
     }
 
@@ -0,0 +1,98 @@
+#include "jdesp.h"
+
+#if JD_TRACE_EVENTS
+
+#include "esp_timer.h"
+
+// Events are recorded until the buffer fills up, then dumped (a few lines per main loop
+// iteration) to stdout, after which recording starts again.
+// Use scripts/trace2chrome.js to convert the dump into Chrome/Perfetto JSON.
+
+#ifndef JD_TRACE_SIZE
+#define JD_TRACE_SIZE 1024
+#endif
+#define TRACE_LINES_PER_LOOP 8
+
+typedef struct {
+    uint32_t time_us;
+    uint32_t arg;
+    uint32_t task;
+    uint8_t id;
+    uint8_t kind;
+} trace_ev_t;
+
+static trace_ev_t trace_buf[JD_TRACE_SIZE];
+static uint32_t trace_ptr;
+static uint32_t dump_ptr;
+
+static const char *trace_names[] = {
+    // LOOP_PHASE_* ids are named with loop_phase_name()
+    [TRACE_ISR_JACDAC] = "isr_jacdac",
+    [TRACE_ISR_USB] = "isr_usb",
+    [TRACE_JD_TIMER] = "jd_timer",
+    [TRACE_TIM_WORKER] = "tim_worker",
+    [TRACE_WORKER_ITEM] = "worker_item",
+    [TRACE_SOCK_OPEN] = "sock_open",
+    [TRACE_SOCK_WRITE] = "sock_write",
+};
+
+IRAM_ATTR void trace_event(uint8_t kind, uint8_t id, uint32_t arg) {
+    uint32_t idx = __atomic_fetch_add(&trace_ptr, 1, __ATOMIC_RELAXED);
+    if (idx >= JD_TRACE_SIZE)
+        return;
+    trace_ev_t *e = &trace_buf[idx];
+    e->time_us = (uint32_t)esp_timer_get_time();
+    e->arg = arg;
+    e->task = xPortInIsrContext() ? 0 : (uint32_t)xTaskGetCurrentTaskHandle();
+    e->id = id;
+    e->kind = kind;
+}
+
+static void dump_header(void) {
+    printf("TR-START %d\n", JD_TRACE_SIZE);
+    for (unsigned i = LOOP_PHASE_IDLE + 1; i < LOOP_PHASE_NUM; ++i)
+        printf("TR-NAME %u %s\n", i, loop_phase_name(i));
+    for (unsigned i = LOOP_PHASE_NUM; i < sizeof(trace_names) / sizeof(trace_names[0]); ++i)
+        if (trace_names[i])
+            printf("TR-NAME %u %s\n", i, trace_names[i]);
+    // tasks can't be named from the dump alone, so list the ones seen in the buffer
+    uint32_t prev = 0;
+    for (unsigned i = 0; i < JD_TRACE_SIZE; ++i) {
+        uint32_t t = trace_buf[i].task;
+        if (t && t != prev) {
+            bool seen = false;
+            for (unsigned j = 0; j < i; ++j)
+                if (trace_buf[j].task == t) {
+                    seen = true;
+                    break;
+                }
+            if (!seen)
+                printf("TR-TASK %x %s\n", (unsigned)t, pcTaskGetName((TaskHandle_t)t));
+        }
+        prev = t;
+    }
+}
+
+void trace_process(void) {
+    if (trace_ptr < JD_TRACE_SIZE)
+        return;
+
+    if (dump_ptr == 0)
+        dump_header();
+
+    for (int i = 0; i < TRACE_LINES_PER_LOOP && dump_ptr < JD_TRACE_SIZE; ++i) {
+        trace_ev_t *e = &trace_buf[dump_ptr++];
+        printf("TR %u %c %u %x %x\n", (unsigned)e->time_us, e->kind, e->id, (unsigned)e->task,
+               (unsigned)e->arg);
+    }
+
+    if (dump_ptr >= JD_TRACE_SIZE) {
+        printf("TR-END\n");
+        dump_ptr = 0;
+        __atomic_store_n(&trace_ptr, 0, __ATOMIC_RELAXED);
+    }
+}
+
+#else
+void trace_process(void) {}
+#endif
@@ -146,6 +146,7 @@ void jd_usb_pull_ready(void) {
 }
 
 static void usb_serial_jtag_isr_handler(void *arg) {
+    TRACE_BEGIN(TRACE_ISR_USB, 0);
     uint32_t st = usb_serial_jtag_ll_get_intsts_mask();
 
     if (st & USB_SERIAL_JTAG_INTR_SERIAL_IN_EMPTY) {
@@ -163,6 +164,7 @@ static void usb_serial_jtag_isr_handler(void *arg) {
         if (r)
             jd_usb_push(buf, r);
     }
+    TRACE_END(TRACE_ISR_USB);
 }
 
 void phy_bbpll_en_usb(bool en);
@@ -227,12 +229,14 @@ static JD_FAST void read_fifo(void) {
 }
 
 static JD_FAST void uart_isr(void *dummy) {
+    TRACE_BEGIN(TRACE_ISR_USB, 0);
     uint32_t uart_intr_status = uart_hw->int_st.val;
 
     read_fifo();
     fill_buffer();
 
     uart_hw->int_clr.val = uart_intr_status; // clear all
+    TRACE_END(TRACE_ISR_USB);
 }
 
 void jd_usb_pull_ready(void) {
@@ -2,7 +2,10 @@
 #include "freertos/event_groups.h"
 #include "esp_wifi.h"
 #include "esp_mac.h"
-#include "nvs_flash.h"
+#include "esp_timer.h"
+#include "mbedtls/md.h"
+#include "mbedtls/pkcs5.h"
+#include "mbedtls/sha256.h"
 
 #if JD_WIFI
 
@@ -11,25 +14,182 @@
 
 static const char *TAG = "wifi";
 
+// WiFi driver is started in background (see boot_run_bg()); requests that come before it's up
+// are kept here
+static bool wifi_started;
+static bool scan_pending, connect_pending;
+// as passed to jd_wifi_connect()
+static wifi_config_t sta_cfg;
+
 int jd_wifi_start_scan(void) {
+    if (!wifi_started) {
+        scan_pending = true;
+        return 0;
+    }
     log_free_mem();
     wifi_scan_config_t scan_config = {0};
     return esp_wifi_scan_start(&scan_config, false);
 }
 
+// Fast reconnect.
+// After a successful connection, the AP's BSSID and channel, and the PMK derived from the
+// password, are kept in settings. The next connection to the same network then skips the
+// all-channel scan and the PBKDF2 key derivation (4096 rounds of HMAC-SHA1, which takes about
+// a second). If the AP doesn't answer there, we fall back to a regular connection.
+
+#define WIFI_FAST_SETTING "wifi_fast"
+#define PMK_ITERATIONS 4096
+#define WIFI_DEFAULT_LISTEN_INTERVAL 10
+
+typedef struct {
+    uint8_t ssid[32];
+    uint8_t pw_hash[8];
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t has_pmk;
+    uint8_t pmk[32];
+} wifi_fast_t;
+
+typedef struct {
+    wifi_fast_t fast;
+    char pw[65];
+} pmk_req_t;
+
+static wifi_fast_t fast;
+static bool fast_loaded, fast_attempt, have_ip;
+static uint8_t curr_bssid[6], curr_channel;
+static int64_t connect_start, assoc_time;
+static worker_t pmk_worker;
+static uint16_t listen_interval;
+
+static void hash_password(const wifi_config_t *cfg, uint8_t out[8]) {
+    uint8_t h[32];
+    const char *pw = (const char *)cfg->sta.password;
+    mbedtls_sha256((const uint8_t *)pw, strnlen(pw, sizeof(cfg->sta.password)), h, 0);
+    memcpy(out, h, 8);
+}
+
+static bool fast_matches(const wifi_config_t *cfg) {
+    if (!fast_loaded) {
+        fast_loaded = true;
+        if (jd_settings_get_bin(WIFI_FAST_SETTING, &fast, sizeof(fast)) != sizeof(fast))
+            memset(&fast, 0, sizeof(fast));
+    }
+    uint8_t h[8];
+    hash_password(cfg, h);
+    return fast.channel && memcmp(fast.ssid, cfg->sta.ssid, sizeof(fast.ssid)) == 0 &&
+           memcmp(fast.pw_hash, h, sizeof(h)) == 0;
+}
+
+static void fast_apply(wifi_config_t *cfg) {
+    cfg->sta.bssid_set = 1;
+    memcpy(cfg->sta.bssid, fast.bssid, 6);
+    cfg->sta.channel = fast.channel;
+    if (fast.has_pmk) {
+        // 64 hex digits (no NUL) are taken as the PSK itself
+        static const char hex[] = "0123456789abcdef";
+        for (int i = 0; i < 32; ++i) {
+            cfg->sta.password[2 * i] = hex[fast.pmk[i] >> 4];
+            cfg->sta.password[2 * i + 1] = hex[fast.pmk[i] & 0xf];
+        }
+    }
+}
+
+static void save_fast(void *arg) {
+    pmk_req_t *req = arg;
+    fast = req->fast;
+    fast_loaded = true;
+    jd_settings_set_bin(WIFI_FAST_SETTING, &fast, sizeof(fast));
+    LOG("cached AP " MACSTR " on channel %d%s", MAC2STR(fast.bssid), fast.channel,
+        fast.has_pmk ? " with PMK" : "");
+    jd_free(req);
+}
+
+static void compute_pmk(void *arg) {
+    pmk_req_t *req = arg;
+    unsigned pwlen = strlen(req->pw);
+    if (pwlen == 64) {
+        // already a PSK
+        for (int i = 0; i < 32; ++i) {
+            char tmp[3] = {req->pw[2 * i], req->pw[2 * i + 1], 0};
+            req->fast.pmk[i] = strtol(tmp, NULL, 16);
+        }
+        req->fast.has_pmk = 1;
+    } else if (pwlen) {
+        int64_t t0 = esp_timer_get_time();
+        mbedtls_md_context_t ctx;
+        mbedtls_md_init(&ctx);
+        CHK(mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), 1));
+        int r = mbedtls_pkcs5_pbkdf2_hmac(&ctx, (const uint8_t *)req->pw, pwlen, req->fast.ssid,
+                                          strnlen((char *)req->fast.ssid, 32), PMK_ITERATIONS,
+                                          32, req->fast.pmk);
+        mbedtls_md_free(&ctx);
+        req->fast.has_pmk = r == 0;
+        LOG("PMK derived in %ums", (unsigned)((esp_timer_get_time() - t0) / 1000));
+    }
+    worker_run(main_worker, save_fast, req);
+}
+
+static void update_fast(void) {
+    bool same_net = fast_matches(&sta_cfg);
+    if (same_net && fast.channel == curr_channel && memcmp(fast.bssid, curr_bssid, 6) == 0)
+        return;
+
+    pmk_req_t *req = jd_alloc(sizeof(pmk_req_t));
+    memcpy(req->fast.ssid, sta_cfg.sta.ssid, sizeof(req->fast.ssid));
+    hash_password(&sta_cfg, req->fast.pw_hash);
+    memcpy(req->fast.bssid, curr_bssid, 6);
+    req->fast.channel = curr_channel;
+
+    if (same_net && fast.has_pmk) {
+        // same network, different AP; the PMK doesn't change
+        req->fast.has_pmk = 1;
+        memcpy(req->fast.pmk, fast.pmk, sizeof(fast.pmk));
+        save_fast(req);
+    } else {
+        memcpy(req->pw, sta_cfg.sta.password, sizeof(sta_cfg.sta.password));
+        req->pw[64] = 0;
+        if (!pmk_worker)
+            pmk_worker = worker_start("wifi_pmk", 4096);
+        worker_run(pmk_worker, compute_pmk, req);
+    }
+}
+
+static void start_connect(bool use_fast) {
+    wifi_config_t cfg = sta_cfg;
+    cfg.sta.listen_interval = listen_interval;
+    fast_attempt = use_fast && fast_matches(&cfg);
+    if (fast_attempt)
+        fast_apply(&cfg);
+    have_ip = false;
+    if (!use_fast)
+        LOG("fast connect failed, doing full scan");
+    else
+        connect_start = esp_timer_get_time();
+    assoc_time = 0;
+    ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &cfg));
+    ESP_ERROR_CHECK(esp_wifi_connect());
+}
+
 int jd_wifi_connect(const char *ssid, const char *pw) {
-    wifi_config_t cfg;
-    memset(&cfg, 0, sizeof(cfg));
+    memset(&sta_cfg, 0, sizeof(sta_cfg));
 
     if (!pw)
         pw = "";
 
-    strlcpy((char *)cfg.sta.ssid, ssid, sizeof(cfg.sta.ssid));
-    strlcpy((char *)cfg.sta.password, pw, sizeof(cfg.sta.password));
+    strlcpy((char *)sta_cfg.sta.ssid, ssid, sizeof(sta_cfg.sta.ssid));
+    if (strlen(pw) == 64)
+        memcpy(sta_cfg.sta.password, pw, 64); // PSK; doesn't fit with the NUL
+    else
+        strlcpy((char *)sta_cfg.sta.password, pw, sizeof(sta_cfg.sta.password));
+
+    if (!wifi_started) {
+        connect_pending = true;
+        return 0;
+    }
 
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &cfg));
-    ESP_ERROR_CHECK(esp_wifi_connect());
+    start_connect(true);
 
     return 0;
 }
@@ -93,30 +253,95 @@ static void scan_done_handler(void *arg, esp_event_base_t event_base, int32_t ev
     jd_wifi_scan_done_cb(res, sta_number);
 }
 
+static void connected_handler(void *arg, esp_event_base_t event_base, int32_t event_id,
+                              void *event_data) {
+    wifi_event_sta_connected_t *ev = event_data;
+    memcpy(curr_bssid, ev->bssid, 6);
+    curr_channel = ev->channel;
+    assoc_time = esp_timer_get_time();
+}
+
 static void got_ip_handler(void *arg, esp_event_base_t event_base, int32_t event_id,
                            void *event_data) {
     ip_event_got_ip_t *ev = event_data;
+    int64_t t = esp_timer_get_time();
+    if (connect_start && assoc_time) {
+        LOG("connected in %ums (%s): association %ums, DHCP %ums",
+            (unsigned)((t - connect_start) / 1000), fast_attempt ? "fast" : "full",
+            (unsigned)((assoc_time - connect_start) / 1000), (unsigned)((t - assoc_time) / 1000));
+        connect_start = 0;
+    }
+    have_ip = true;
+    fast_attempt = false;
+    if (curr_channel)
+        update_fast();
     jd_wifi_got_ip_cb(ev->ip_info.ip.addr);
+    wifibench_start();
 }
 
 static void disconnect_handler(void *arg, esp_event_base_t event_base, int32_t event_id,
                                void *event_data) {
+    if (fast_attempt && !have_ip) {
+        // the cached AP is gone or the cache is stale; retry the regular way
+        start_connect(false);
+        return;
+    }
+    have_ip = false;
     jd_wifi_lost_ip_cb();
 }
 
-int jd_wifi_init(uint8_t mac_out[6]) {
-    LOG("starting...");
+static void on_wifi_started(void *arg) {
+    wifi_started = true;
+    if (connect_pending) {
+        // connecting takes precedence over the scan, which would abort it
+        connect_pending = false;
+        if (scan_pending) {
+            scan_pending = false;
+            jd_wifi_scan_done_cb(NULL, 0);
+        }
+        start_connect(true);
+    } else if (scan_pending) {
+        scan_pending = false;
+        jd_wifi_start_scan();
+    }
+}
 
-    esp_log_level_set(TAG, ESP_LOG_INFO);
-    esp_efuse_mac_get_default(mac_out);
+// Power-save/throughput trade-off, selected with wifi.profile in device config:
+// - "throughput": no power save, 40MHz channel (if the AP supports it)
+// - "balanced": modem sleep between DTIM beacons (the IDF default)
+// - "lowPower": modem sleep for wifi.listenInterval beacons; adds that much latency
+static void apply_profile(void) {
+    const char *profile = dcfg_get_string("wifi.profile", "balanced");
+    wifi_ps_type_t ps = WIFI_PS_MIN_MODEM;
+    wifi_bandwidth_t bw = WIFI_BW_HT20;
+
+    if (strcmp(profile, "throughput") == 0) {
+        ps = WIFI_PS_NONE;
+        bw = WIFI_BW_HT40;
+    } else if (strcmp(profile, "lowPower") == 0) {
+        ps = WIFI_PS_MAX_MODEM;
+        listen_interval = dcfg_get_i32("wifi.listenInterval", WIFI_DEFAULT_LISTEN_INTERVAL);
+    } else if (strcmp(profile, "balanced") != 0) {
+        LOG("unknown profile '%s'", profile);
+        profile = "balanced";
+    }
 
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
+    ESP_ERROR_CHECK(esp_wifi_set_bandwidth(WIFI_IF_STA, bw));
+    ESP_ERROR_CHECK(esp_wifi_set_ps(ps));
+
+    // in 0.25dBm units, limited to 2-20dBm
+    int tx = dcfg_get_i32("wifi.maxTxPowerDbm", 0);
+    if (tx) {
+        esp_err_t r = esp_wifi_set_max_tx_power(tx * 4);
+        if (r)
+            LOG("can't set TX power to %ddBm: %d", tx, r);
     }
-    JD_CHK(ret);
 
+    LOG("profile %s", profile);
+}
+
+static void wifi_start(void *arg) {
+    // NVS (used by the driver for calibration data) is initialized in flash_init()
     ESP_ERROR_CHECK(esp_netif_init());
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
@@ -130,6 +355,8 @@ int jd_wifi_init(uint8_t mac_out[6]) {
 
     ESP_ERROR_CHECK(
         esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, &scan_done_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED,
+                                               &connected_handler, NULL));
     ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED,
                                                &disconnect_handler, NULL));
     ESP_ERROR_CHECK(
@@ -137,11 +364,29 @@ int jd_wifi_init(uint8_t mac_out[6]) {
     ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_start());
+    apply_profile();
+
+    boot_mark("WiFi started");
+    worker_run(main_worker, on_wifi_started, NULL);
+}
+
+int jd_wifi_init(uint8_t mac_out[6]) {
+    LOG("starting...");
+
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+    esp_efuse_mac_get_default(mac_out);
+
+    boot_run_bg("wifi", wifi_start, NULL);
 
     return 0;
 }
 
 int jd_wifi_disconnect(void) {
+    if (!wifi_started) {
+        connect_pending = false;
+        return 0;
+    }
+    fast_attempt = false;
     ESP_ERROR_CHECK(esp_wifi_disconnect());
     return 0;
 }
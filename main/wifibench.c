@@ -0,0 +1,92 @@
+#include "jdesp.h"
+
+#if JD_WIFI && JD_WIFI_BENCH
+
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+
+// Echo client for scripts/wifibench.js: once we have an IP, connect to wifi.benchHost
+// ("host" or "host:port") and send back everything received.
+// Uses plain lwIP sockets on its own task, so neither the VM nor tcpsock is in the way.
+
+#define LOG(msg, ...) DMESG("wifibench: " msg, ##__VA_ARGS__)
+
+#define BENCH_DEFAULT_PORT "7007"
+#define BENCH_BUF_SIZE 2920
+
+static worker_t bench_worker;
+static bool bench_running;
+
+static int send_all(int fd, const uint8_t *buf, int size) {
+    while (size > 0) {
+        int n = send(fd, buf, size, 0);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static void bench_run(void *arg) {
+    char host[64];
+    strlcpy(host, dcfg_get_string("wifi.benchHost", ""), sizeof(host));
+    const char *port = BENCH_DEFAULT_PORT;
+    char *colon = strchr(host, ':');
+    if (colon) {
+        *colon = 0;
+        port = colon + 1;
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(host, port, &hints, &res) != 0 || !res) {
+        LOG("can't resolve '%s'", host);
+        bench_running = false;
+        return;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int r = connect(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (r != 0) {
+        LOG("can't connect to %s:%s: %s", host, port, strerror(errno));
+        close(fd);
+        bench_running = false;
+        return;
+    }
+
+    LOG("connected to %s:%s", host, port);
+
+    uint8_t *buf = jd_alloc(BENCH_BUF_SIZE);
+    uint32_t total = 0;
+    for (;;) {
+        int n = recv(fd, buf, BENCH_BUF_SIZE, 0);
+        if (n <= 0 || send_all(fd, buf, n) != 0)
+            break;
+        total += n;
+    }
+    jd_free(buf);
+    close(fd);
+
+    LOG("done; echoed %u bytes", (unsigned)total);
+    bench_running = false;
+}
+
+void wifibench_start(void) {
+    if (bench_running || !dcfg_get_string("wifi.benchHost", NULL))
+        return;
+    bench_running = true;
+    if (!bench_worker)
+        bench_worker = worker_start("wifibench", 4096);
+    worker_run(bench_worker, bench_run, NULL);
+}
+
+#else
+void wifibench_start(void) {}
+#endif
@@ -17,9 +17,11 @@ void worker_do_work(worker_t w) {
         if (w->fn)
             w->fn(w->arg);
         qitem_t evt;
-        if (xQueueReceive(w->queue, &evt, 0))
+        if (xQueueReceive(w->queue, &evt, 0)) {
+            TRACE_BEGIN(TRACE_WORKER_ITEM, evt.fn);
             evt.fn(evt.arg);
-        else
+            TRACE_END(TRACE_WORKER_ITEM);
+        } else
             break;
     }
 }
@@ -28,8 +30,11 @@ static void worker_main(void *arg) {
     worker_t w = (worker_t)arg;
     while (1) {
         qitem_t evt;
-        if (xQueueReceive(w->queue, &evt, w->fn ? 20 : 1))
+        if (xQueueReceive(w->queue, &evt, w->fn ? 20 : 1)) {
+            TRACE_BEGIN(TRACE_WORKER_ITEM, evt.fn);
             evt.fn(evt.arg);
+            TRACE_END(TRACE_WORKER_ITEM);
+        }
         if (w->fn)
             w->fn(w->arg);
     }
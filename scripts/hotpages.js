@@ -0,0 +1,78 @@
+// Ranks DeviceScript bytecode chunks by samples, from HP-* lines in device log (see main/hotpages.c).
+//
+// Usage: node scripts/hotpages.js device.log
+//
+// Also reports how many 4KB flash pages cover 50/90/99% of samples, i.e., the working set that
+// has to stay in flash cache; compare before and after changing the program layout.
+
+let fs = require("fs")
+
+const flashPage = 4096
+
+const args = process.argv.slice(2)
+const log = fs.readFileSync(args[0] || 0, "utf-8")
+
+const counts = {}
+let bucket = 256
+let total = 0
+let idle = 0
+let dumps = 0
+
+for (const line of log.split(/\r?\n/)) {
+    const words = line.replace(/^.*?(HP[ -])/, "$1").trim().split(/\s+/)
+    switch (words[0]) {
+        case "HP-START":
+            bucket = parseInt(words[1])
+            total += parseInt(words[2])
+            idle += parseInt(words[3])
+            dumps++
+            break
+        case "HP": {
+            const off = parseInt(words[1])
+            counts[off] = (counts[off] || 0) + parseInt(words[2])
+            break
+        }
+    }
+}
+
+if (!total) {
+    console.error("no HP-* lines found; build with -DJD_HOTPAGES=1")
+    process.exit(1)
+}
+
+const hex = n => "0x" + n.toString(16).padStart(5, "0")
+const pct = n => ((100 * n) / total).toFixed(1).padStart(5) + "%"
+
+console.log(
+    `${dumps} dumps, ${total} samples in VM, ${idle} outside (${bucket}B chunks)`
+)
+console.log("")
+console.log("offset    samples      %    cum.")
+
+const ranked = Object.keys(counts)
+    .map(k => ({ off: parseInt(k), n: counts[k] }))
+    .sort((a, b) => b.n - a.n)
+let cum = 0
+for (const e of ranked) {
+    cum += e.n
+    console.log(
+        `${hex(e.off)}  ${e.n.toString().padStart(8)} ${pct(e.n)} ${pct(cum)}`
+    )
+}
+
+const pages = {}
+for (const e of ranked) {
+    const p = Math.floor(e.off / flashPage)
+    pages[p] = (pages[p] || 0) + e.n
+}
+const pageCounts = Object.values(pages).sort((a, b) => b - a)
+
+console.log("")
+for (const level of [50, 90, 99]) {
+    let sum = 0
+    let n = 0
+    while (sum * 100 < total * level) sum += pageCounts[n++]
+    console.log(
+        `${level}% of samples in ${n} of ${pageCounts.length} touched flash pages`
+    )
+}
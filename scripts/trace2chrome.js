@@ -0,0 +1,78 @@
+// Converts trace dump (TR-* lines in device log, see main/trace.c) into Chrome trace-event JSON.
+// Open the result in chrome://tracing or https://ui.perfetto.dev
+//
+// Usage: node scripts/trace2chrome.js device.log > trace.json
+//
+// When build/espjd.elf is present, worker item addresses are resolved to function names.
+
+let fs = require("fs")
+let child_process = require("child_process")
+
+const buildPath = "build/"
+const elfpath = buildPath + "espjd.elf"
+
+const args = process.argv.slice(2)
+const log = fs.readFileSync(args[0] || 0, "utf-8")
+
+const symbols = {}
+try {
+    const js = JSON.parse(fs.readFileSync(buildPath + "compile_commands.json", "utf-8"))
+    const nm = js[0].command.replace(/ .*/, "").replace(/-gcc$/, "-nm")
+    const out = child_process.execSync(`${nm} ${elfpath}`, { encoding: "utf8" })
+    for (const line of out.split(/\n/)) {
+        const m = /^([0-9a-f]+) [tT] (\S+)/.exec(line)
+        if (m) symbols[parseInt(m[1], 16)] = m[2]
+    }
+} catch {
+    console.error("no ELF symbols; worker items will show addresses")
+}
+
+const names = {}
+const tasks = { "0": "ISR" }
+const events = []
+let dumpNo = 0
+
+for (const line of log.split(/\r?\n/)) {
+    const words = line.replace(/^.*?(TR[ -])/, "$1").trim().split(/\s+/)
+    switch (words[0]) {
+        case "TR-START":
+            dumpNo++
+            break
+        case "TR-NAME":
+            names[words[1]] = words[2]
+            break
+        case "TR-TASK":
+            tasks[words[1]] = words[2]
+            break
+        case "TR": {
+            const [, time, kind, id, task, arg] = words
+            const ev = {
+                name: names[id] || "ev" + id,
+                ph: kind,
+                ts: parseInt(time),
+                pid: dumpNo,
+                tid: task,
+            }
+            const argv = parseInt(arg, 16)
+            if (kind == "B" && argv) {
+                const sym = symbols[argv]
+                if (sym && ev.name == "worker_item") ev.name = sym
+                else ev.args = { arg: "0x" + argv.toString(16) }
+            }
+            events.push(ev)
+            break
+        }
+    }
+}
+
+for (const task of Object.keys(tasks))
+    for (let pid = 1; pid <= dumpNo; ++pid)
+        events.push({
+            name: "thread_name",
+            ph: "M",
+            pid,
+            tid: task,
+            args: { name: tasks[task] },
+        })
+
+console.log(JSON.stringify({ traceEvents: events }))
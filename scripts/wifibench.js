@@ -0,0 +1,117 @@
+// Throughput/latency benchmark for WiFi profiles (wifi.profile in device config).
+// Runs a TCP server; a device built with -DJD_WIFI_BENCH=1 and with wifi.benchHost set to
+// this machine's address connects once it has an IP, and echoes back everything it gets
+// (see main/wifibench.c).
+//
+// Usage: node scripts/wifibench.js [port] [seconds per phase]
+//
+// Phases are printed with timestamps, so readings from an external current meter can be
+// matched up with them; the idle phase shows the power-save floor.
+
+let net = require("net")
+
+const args = process.argv.slice(2)
+const port = parseInt(args[0] || "7007")
+const phaseS = parseInt(args[1] || "10")
+
+const numPings = 200
+const pingSize = 32
+const chunkSize = 1400
+const window = 32 * 1024
+
+const t0 = Date.now()
+const stamp = () => ((Date.now() - t0) / 1000).toFixed(1).padStart(7) + "s"
+const log = msg => console.log(`${stamp()} ${msg}`)
+const sleep = ms => new Promise(resolve => setTimeout(resolve, ms))
+
+function stats(rtts) {
+    const s = rtts.slice().sort((a, b) => a - b)
+    const q = p => s[Math.min(s.length - 1, Math.floor((s.length * p) / 100))]
+    return `min ${s[0].toFixed(1)}ms, p50 ${q(50).toFixed(1)}ms, p90 ${q(
+        90
+    ).toFixed(1)}ms, p99 ${q(99).toFixed(1)}ms, max ${s[s.length - 1].toFixed(1)}ms`
+}
+
+async function bench(sock) {
+    let sent = 0
+    let received = 0
+    let waiter = null
+    let closed = false
+
+    sock.setNoDelay(true)
+    sock.on("data", buf => {
+        received += buf.length
+        if (waiter && received >= waiter.target) {
+            const w = waiter
+            waiter = null
+            w.resolve()
+        }
+    })
+    sock.on("close", () => {
+        closed = true
+        if (waiter) waiter.reject(new Error("connection closed"))
+    })
+
+    const waitFor = target =>
+        received >= target
+            ? Promise.resolve()
+            : new Promise((resolve, reject) => {
+                  waiter = { target, resolve, reject }
+              })
+
+    async function ping() {
+        const start = process.hrtime.bigint()
+        sock.write(Buffer.alloc(pingSize, 0x55))
+        sent += pingSize
+        await waitFor(sent)
+        return Number(process.hrtime.bigint() - start) / 1e6
+    }
+
+    log(`latency: ${numPings} x ${pingSize}B round-trips`)
+    const rtts = []
+    for (let i = 0; i < numPings; ++i) rtts.push(await ping())
+    log(`latency: ${stats(rtts)}`)
+
+    log(`throughput: echoing for ${phaseS}s`)
+    const chunk = Buffer.alloc(chunkSize, 0xaa)
+    const start = received
+    const end = Date.now() + phaseS * 1000
+    const tstart = Date.now()
+    while (Date.now() < end && !closed) {
+        while (sent - received < window) {
+            sock.write(chunk)
+            sent += chunk.length
+        }
+        await waitFor(sent - window / 2)
+    }
+    await waitFor(sent)
+    const kb = (received - start) / 1024
+    const secs = (Date.now() - tstart) / 1000
+    log(`throughput: ${kb.toFixed(0)}kB each way, ${(kb / secs).toFixed(1)}kB/s`)
+
+    log(`idle: one ping per second for ${phaseS}s`)
+    const idle = []
+    for (let i = 0; i < phaseS; ++i) {
+        await sleep(1000)
+        idle.push(await ping())
+    }
+    log(`idle: ${stats(idle)}`)
+
+    sock.end()
+}
+
+const server = net.createServer(sock => {
+    log(`device connected from ${sock.remoteAddress}`)
+    bench(sock).then(
+        () => {
+            log("done")
+            server.close()
+        },
+        err => {
+            log(`failed: ${err.message}`)
+            server.close()
+        }
+    )
+})
+
+server.listen(port, () => log(`waiting for device on port ${port}`))